@@ -77,6 +77,8 @@ int ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
   int offset = connData->post->received - connData->post->buffLen;
   if (offset == 0) {
     connData->cgiPrivData = NULL;
+    // get the rest in whole flash sectors, that's one erase and one write per callback
+    httpdSetPostChunks(connData, SPI_FLASH_SEC_SIZE, 0);
   } else if (connData->cgiPrivData != NULL) {
     // we have an error condition, do nothing
     return HTTPD_CGI_DONE;
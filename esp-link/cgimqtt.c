@@ -14,6 +14,7 @@ char *mqttState(void) {
 #include "config.h"
 #include "status.h"
 #include "mqtt_client.h"
+#include "mqtt_spool.h"
 #include "cgimqtt.h"
 
 #ifdef CGIMQTT_DBG
@@ -47,15 +48,35 @@ int ICACHE_FLASH_ATTR cgiMqttGet(HttpdConnData *connData) {
   }
   *sb2 = 0;
 
+  // offline spool status
+  char spool_buf[48];
+  MqttSpool *spool = mqttClient.spool;
+  if (spool == NULL)
+    os_strcpy(spool_buf, "off");
+  else
+    os_sprintf(spool_buf, "%d queued, %lu dropped", spool->count, (unsigned long)spool->dropped);
+
+  // time it took to reconnect after losing the connection
+  char recon_buf[64];
+  MQTT_Client *c = &mqttClient;
+  os_sprintf(recon_buf, "%lu, last %lums, avg %lums, max %lums", (unsigned long)c->reconnects,
+      (unsigned long)c->reconLastMs,
+      (unsigned long)(c->reconnects > 0 ? c->reconSumMs / c->reconnects : 0),
+      (unsigned long)c->reconMaxMs);
+
   len = os_sprintf(buff, "{ "
       "\"slip-enable\":%d, "
       "\"mqtt-enable\":%d, "
       "\"mqtt-state\":\"%s\", "
       "\"mqtt-status-enable\":%d, "
       "\"mqtt-clean-session\":%d, "
+      "\"mqtt-v5\":%d, "
       "\"mqtt-port\":%d, "
       "\"mqtt-timeout\":%d, "
       "\"mqtt-keepalive\":%d, "
+      "\"mqtt-spool-max\":%d, "
+      "\"mqtt-spool-state\":\"%s\", "
+      "\"mqtt-recon-state\":\"%s\", "
       "\"mqtt-host\":\"%s\", "
       "\"mqtt-client-id\":\"%s\", "
       "\"mqtt-username\":\"%s\", "
@@ -64,8 +85,9 @@ int ICACHE_FLASH_ATTR cgiMqttGet(HttpdConnData *connData) {
       "\"mqtt-status-value\":\"%s\" }",
       flashConfig.slip_enable, flashConfig.mqtt_enable,
       mqtt_states[mqttClient.connState], flashConfig.mqtt_status_enable,
-      flashConfig.mqtt_clean_session, flashConfig.mqtt_port,
+      flashConfig.mqtt_clean_session, flashConfig.mqtt_v5, flashConfig.mqtt_port,
       flashConfig.mqtt_timeout, flashConfig.mqtt_keepalive,
+      flashConfig.mqtt_spool_max, spool_buf, recon_buf,
       flashConfig.mqtt_host, flashConfig.mqtt_clientid,
       flashConfig.mqtt_username, flashConfig.mqtt_password,
       flashConfig.mqtt_status_topic, status_buf2);
@@ -97,6 +119,9 @@ int ICACHE_FLASH_ATTR cgiMqttSet(HttpdConnData *connData) {
   mqtt_server |= getBoolArg(connData, "mqtt-clean-session",
       &flashConfig.mqtt_clean_session);
 
+  if (mqtt_server < 0) return HTTPD_CGI_DONE;
+  mqtt_server |= getBoolArg(connData, "mqtt-v5", &flashConfig.mqtt_v5);
+
   if (mqtt_server < 0) return HTTPD_CGI_DONE;
   int8_t mqtt_en_chg = getBoolArg(connData, "mqtt-enable",
       &flashConfig.mqtt_enable);
@@ -127,6 +152,19 @@ int ICACHE_FLASH_ATTR cgiMqttSet(HttpdConnData *connData) {
     flashConfig.mqtt_keepalive = keepalive;
   }
 
+  // handle mqtt offline spool size, the spool is set up when the client gets initialized
+  if (httpdFindArg(connData->getArgs, "mqtt-spool-max", buff, sizeof(buff)) > 0) {
+    int32_t spool_max = atoi(buff);
+    if (spool_max < 0 || spool_max > 65535) {
+      errorResponse(connData, 400, "Invalid MQTT spool size");
+      return HTTPD_CGI_DONE;
+    }
+    if (spool_max != flashConfig.mqtt_spool_max) {
+      flashConfig.mqtt_spool_max = spool_max;
+      mqtt_server |= 1;
+    }
+  }
+
   // if server setting changed, we need to "make it so"
   if (mqtt_server) {
     DBG("MQTT server settings changed, enable=%d\n", flashConfig.mqtt_enable);
@@ -2,9 +2,13 @@
 #include <esp8266.h>
 #include "cgiwifi.h"
 #include "cgi.h"
+#include "espfs.h"
 #include "config.h"
 #include "sntp.h"
 #include "cgimqtt.h"
+#ifdef MQTT
+#include "pktbuf.h"
+#endif
 #ifdef SYSLOG
 #include "syslog.h"
 #endif
@@ -63,6 +67,20 @@ int ICACHE_FLASH_ATTR cgiSystemInfo(HttpdConnData *connData) {
   uint8 part_id = system_upgrade_userbin_check();
   uint32_t fid = spi_flash_get_id();
   struct rst_info *rst_info = system_get_rst_info();
+  int httpBytes, httpConns = httpdConnStats(&httpBytes);
+  uint32_t fsHits, fsMisses;
+  espFsCacheStats(&fsHits, &fsMisses);
+#ifdef MQTT
+  int pbNum;
+  const PktBufPool *pb = PktBuf_GetStats(&pbNum);
+  uint32_t pbInUse = 0, pbPooled = 0, pbAllocs = 0, pbReuses = 0;
+  for (int i=0; i<pbNum; i++) {
+    pbInUse += pb[i].inUse;
+    pbPooled += pb[i].pooled;
+    pbAllocs += pb[i].allocs;
+    pbReuses += pb[i].reuses;
+  }
+#endif
 
   os_sprintf(buff,
     "{ "
@@ -75,6 +93,12 @@ int ICACHE_FLASH_ATTR cgiSystemInfo(HttpdConnData *connData) {
       "\"slip\": \"%s\", "
       "\"mqtt\": \"%s/%s\", "
       "\"baud\": \"%d\", "
+      "\"http-conns\": \"%d\", "
+      "\"http-conn-bytes\": \"%d\", "
+      "\"espfs-cache\": \"%lu hits, %lu misses\", "
+#ifdef MQTT
+      "\"mqtt-bufs\": \"%lu in use, %lu pooled, %lu reused, %lu allocated\", "
+#endif
       "\"description\": \"%s\""
     " }",
     flashConfig.hostname,
@@ -88,6 +112,13 @@ int ICACHE_FLASH_ATTR cgiSystemInfo(HttpdConnData *connData) {
     flashConfig.mqtt_enable ? "enabled" : "disabled",
     mqttState(),
     flashConfig.baud_rate,
+    httpConns,
+    httpConns > 0 ? httpBytes / httpConns : 0,
+    (unsigned long)fsHits, (unsigned long)fsMisses,
+#ifdef MQTT
+    (unsigned long)pbInUse, (unsigned long)pbPooled, (unsigned long)pbReuses,
+    (unsigned long)pbAllocs,
+#endif
     flashConfig.sys_descr
     );
 
@@ -96,6 +127,67 @@ int ICACHE_FLASH_ATTR cgiSystemInfo(HttpdConnData *connData) {
   return HTTPD_CGI_DONE;
 }
 
+// Estimate a percentile of the request durations from the histogram: returns the upper
+// bound of the bucket it falls in, or the max for the last bucket
+static uint32_t ICACHE_FLASH_ATTR httpPercentile(const HttpdRouteStats *st, int pct) {
+  uint32_t total = 0, sum = 0;
+  for (int b=0; b<HTTPD_STATS_BUCKETS; b++) total += st->hist[b];
+  for (int b=0; b<HTTPD_STATS_BUCKETS-1; b++) {
+    sum += st->hist[b];
+    if (sum*100 >= total*pct) return 1UL<<b;
+  }
+  return st->maxMs;
+}
+
+// Cgi to return request statistics per route, one route per callback
+int ICACHE_FLASH_ATTR cgiHttpStats(HttpdConnData *connData) {
+  char buff[256];
+
+  if (connData->conn == NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  int num, i = (int)connData->cgiData; // cgiData: next route to send
+  const HttpdRouteStats *stats = httpdGetStats(&num);
+
+  if (i == 0) {
+    httpdSetTransferMode(connData, HTTPD_TRANSFER_CHUNKED);
+    jsonHeader(connData, 200);
+    httpdSend(connData, "{ \"routes\": [", -1);
+  }
+
+  if (i < num) {
+    const HttpdRouteStats *st = &stats[i];
+    os_sprintf(buff,
+      "%s{ "
+        "\"url\": \"%s\", "
+        "\"count\": %ld, "
+        "\"bytes\": %ld, "
+        "\"4xx\": %d, "
+        "\"5xx\": %d, "
+        "\"ttfb\": %ld, "
+        "\"p50\": %ld, "
+        "\"p95\": %ld, "
+        "\"max\": %ld"
+      " }",
+      i > 0 ? ", " : "",
+      st->url,
+      (long)st->count,
+      (long)st->bytes,
+      st->err4xx,
+      st->err5xx,
+      (long)(st->ttfbSum / st->count),
+      (long)httpPercentile(st, 50),
+      (long)httpPercentile(st, 95),
+      (long)st->maxMs
+      );
+    httpdSend(connData, buff, -1);
+    connData->cgiData = (void *)(i+1);
+    return HTTPD_CGI_MORE;
+  }
+
+  httpdSend(connData, " ] }", -1);
+  return HTTPD_CGI_DONE;
+}
+
 void ICACHE_FLASH_ATTR cgiServicesSNTPInit() {
   if (flashConfig.sntp_server[0] != '\0') {
     sntp_stop();
@@ -5,6 +5,7 @@
 
 int cgiSystemSet(HttpdConnData *connData);
 int cgiSystemInfo(HttpdConnData *connData);
+int cgiHttpStats(HttpdConnData *connData);
 
 void cgiServicesSNTPInit();
 int cgiServicesInfo(HttpdConnData *connData);
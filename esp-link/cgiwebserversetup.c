@@ -8,6 +8,7 @@
 #include "espfsformat.h"
 #include "config.h"
 #include "web-server.h"
+#include "espfs.h"
 
 int header_position = 0;  // flash offset of the file header
 int upload_position = 0;  // flash offset where to store page upload
@@ -80,6 +81,7 @@ void ICACHE_FLASH_ATTR dumpFlash( int end )
 // multipart callback for uploading user defined pages
 int ICACHE_FLASH_ATTR webServerSetupMultipartCallback(MultipartCmd cmd, char *data, int dataLen, int position)
 {
+  espFsFlushCache(); // the user pages are being rewritten, don't serve stale cached blocks
   switch(cmd)
   {
     case FILE_UPLOAD_START:
@@ -93,7 +95,7 @@ int ICACHE_FLASH_ATTR webServerSetupMultipartCallback(MultipartCmd cmd, char *da
         // write the starting block on esp-fs
         EspFsHeader hdr;
         hdr.magic = 0xFFFFFFFF; // espfs magic is invalid during upload
-        hdr.flags = 0;
+        hdr.flags = httpdMimeIndex(data) << FLAG_MIME_SHIFT;
         hdr.compression = 0;
 
         int len = dataLen + 1;
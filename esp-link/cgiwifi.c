@@ -259,6 +259,8 @@ static int ICACHE_FLASH_ATTR cgiWiFiGetScan(HttpdConnData *connData) {
     }
   }
 
+  // the list of APs is streamed over several callbacks, chunked encoding delimits it
+  httpdSetTransferMode(connData, HTTPD_TRANSFER_CHUNKED);
   jsonHeader(connData, 200);
 
   if (cgiWifiAps.scanInProgress==1) {
@@ -257,3 +257,34 @@ const uint32_t getUserPageSectionEnd()
   }
 }
 
+// The MQTT spool uses the lower 8KB of the reserved space next to the settings, which is only
+// free if the user pages don't live there, i.e. with >=2MB flash
+const uint32_t getMqttSpoolSectionStart()
+{
+  enum flash_size_map map = system_get_flash_size_map();
+  switch(map)
+  {
+    case FLASH_SIZE_16M_MAP_512_512:
+    case FLASH_SIZE_16M_MAP_1024_1024:
+    case FLASH_SIZE_32M_MAP_512_512:
+    case FLASH_SIZE_32M_MAP_1024_1024:
+      return FLASH_SECT + FIRMWARE_SIZE;
+    default:
+      return 0xFFFFFFFF;
+  }
+}
+
+const uint32_t getMqttSpoolSectionEnd()
+{
+  enum flash_size_map map = system_get_flash_size_map();
+  switch(map)
+  {
+    case FLASH_SIZE_16M_MAP_512_512:
+    case FLASH_SIZE_16M_MAP_1024_1024:
+    case FLASH_SIZE_32M_MAP_512_512:
+    case FLASH_SIZE_32M_MAP_1024_1024:
+      return FLASH_SECT + FIRMWARE_SIZE + 2*FLASH_SECT;
+    default:
+      return 0xFFFFFFFF;
+  }
+}
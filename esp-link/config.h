@@ -43,6 +43,8 @@ typedef struct {
   int8_t   stop_bits;
   char     mqtt_password[70];          // MQTT password, was 32-char mqtt_old_password
   char     mqtt_username[70];          // MQTT username, was 32-char mqtt_old_username
+  uint16_t mqtt_spool_max;             // max QoS1 publishes spooled to flash while offline, 0=off
+  uint8_t  mqtt_v5;                    // connect with MQTT 5 instead of 3.1.1
 } FlashConfig;
 extern FlashConfig flashConfig;
 
@@ -54,4 +56,7 @@ const size_t getFlashSize();
 const uint32_t getUserPageSectionStart();
 const uint32_t getUserPageSectionEnd();
 
+const uint32_t getMqttSpoolSectionStart();
+const uint32_t getMqttSpoolSectionEnd();
+
 #endif
@@ -92,6 +92,7 @@ HttpdBuiltInUrl builtInUrls[] = {
   { "/console/fmt", ajaxConsoleFormat, NULL },
   { "/console/text", ajaxConsole, NULL },
   { "/console/send", ajaxConsoleSend, NULL },
+  { "/ws/console", cgiWebsocket, consoleWsConnect },
   //Enable the line below to protect the WiFi configuration with an username/password combo.
   //    {"/wifi/*", authBasic, myPassFn},
   { "/wifi", cgiRedirect, "/wifi/wifi.html" },
@@ -105,6 +106,7 @@ HttpdBuiltInUrl builtInUrls[] = {
   { "/wifi/apinfo", cgiApSettingsInfo, NULL },
   { "/wifi/apchange", cgiApSettingsChange, NULL },
   { "/system/info", cgiSystemInfo, NULL },
+  { "/system/httpstats", cgiHttpStats, NULL },
   { "/system/update", cgiSystemSet, NULL },
   { "/services/info", cgiServicesInfo, NULL },
   { "/services/update", cgiServicesSet, NULL },
@@ -3,6 +3,7 @@
 #include "cgiwifi.h"
 #include "config.h"
 #include "mqtt.h"
+#include "mqtt_spool.h"
 
 
 #ifdef MQTTCLIENT_DBG
@@ -42,7 +43,7 @@ mqttPublishedCb(MQTT_Client* client) {
 
 void ICACHE_FLASH_ATTR
 mqttDataCb(MQTT_Client* client, const char* topic, uint32_t topic_len,
-    const char *data, uint32_t data_len)
+    const char *data, uint32_t data_len, uint32_t offset, uint32_t total_len)
 {
 #ifdef MQTTCLIENT_DBG
   char *topicBuf = (char*)os_zalloc(topic_len + 1);
@@ -54,13 +55,14 @@ mqttDataCb(MQTT_Client* client, const char* topic, uint32_t topic_len,
   os_memcpy(dataBuf, data, data_len);
   dataBuf[data_len] = 0;
 
-  os_printf("MQTT Client: Received topic: %s, data: %s\n", topicBuf, dataBuf);
+  os_printf("MQTT Client: Received topic: %s, data[%lu/%lu]: %s\n", topicBuf,
+      (unsigned long)offset, (unsigned long)total_len, dataBuf);
   os_free(topicBuf);
   os_free(dataBuf);
 #endif
 
   if (data_cb)
-    data_cb(client, topic, topic_len, data, data_len);
+    data_cb(client, topic, topic_len, data, data_len, offset, total_len);
 }
 
 void ICACHE_FLASH_ATTR
@@ -82,12 +84,20 @@ mqtt_client_init()
   MQTT_Init(&mqttClient, flashConfig.mqtt_host, flashConfig.mqtt_port, 0, flashConfig.mqtt_timeout,
     flashConfig.mqtt_clientid, flashConfig.mqtt_username, flashConfig.mqtt_password,
     flashConfig.mqtt_keepalive);
+  if (flashConfig.mqtt_v5)
+    MQTT_SetProtocolVersion(&mqttClient, MQTT_PROTOCOL_V5);
 
   MQTT_OnConnected(&mqttClient, mqttConnectedCb);
   MQTT_OnDisconnected(&mqttClient, mqttDisconnectedCb);
   MQTT_OnPublished(&mqttClient, mqttPublishedCb);
   MQTT_OnData(&mqttClient, mqttDataCb);
 
+  // spool QoS1 publishes to flash while offline, if there's room for it in flash
+  uint32_t spool = getMqttSpoolSectionStart();
+  if (flashConfig.mqtt_spool_max > 0 && spool != 0xFFFFFFFF)
+    MQTT_SpoolInit(&mqttClient, spool, (getMqttSpoolSectionEnd()-spool)/SPI_FLASH_SEC_SIZE,
+        flashConfig.mqtt_spool_max);
+
   // Don't connect now, wait for a wifi status change callback
   //if (flashConfig.mqtt_enable && strlen(flashConfig.mqtt_host) > 0)
   //  MQTT_Connect(&mqttClient);
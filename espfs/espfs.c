@@ -14,8 +14,8 @@ It's written for use with httpd, but doesn't need to be used as such.
  */
 
 
-//These routines can also be tested by comping them in with the espfstest tool. This
-//simplifies debugging, but needs some slightly different headers. The #ifdef takes
+//These routines are also compiled into mkespfsimage, which uses them to verify and benchmark
+//the images it makes (-v). That needs some slightly different headers. The #ifdef takes
 //care of that.
 
 #ifdef __ets__
@@ -47,11 +47,23 @@ EspFsContext userPageCtxDef;
 EspFsContext * espLinkCtx = &espLinkCtxDef;
 EspFsContext * userPageCtx = &userPageCtxDef;
 
+//Files opened recently, to skip the index lookup (or header walk) for the usual suspects
+#define ESPFS_CACHE_SIZE 8
+
+typedef struct {
+	uint32_t hash;
+	char    *position;	// file header, NULL if unused
+} EspFsCacheEntry;
+
 struct EspFsContext
 {
 	char*       data;
 	EspFsSource source;
 	uint8_t     valid;
+	uint8_t     cacheNext;	// entry to replace next
+	char*       index;	// EspFsIndex in the image, NULL if there's none
+	int32_t     indexSize;
+	EspFsCacheEntry cache[ESPFS_CACHE_SIZE];
 };
 
 struct EspFsFile {
@@ -64,6 +76,27 @@ struct EspFsFile {
 	void *decompData;
 };
 
+/*
+Heatshrink decoder state. Heatshrink is an LZSS variant made for small memory: the stream is a
+sequence of bits, MSB first, where a 1 is followed by an 8-bit literal and a 0 by a back-reference
+into the last 2^windowBits output bytes, stored as offset-1 (windowBits bits) and count-1
+(lookaheadBits bits). mkespfsimage stores windowBits<<4|lookaheadBits in the first byte of the file.
+Decompressing only needs the window of output history plus a few bytes of state.
+*/
+typedef struct {
+	uint8_t windowBits;
+	uint8_t lookaheadBits;
+	uint8_t bitByte;	// input byte bits are being taken from
+	uint8_t bitMask;	// next bit to take from bitByte, 0 if it's used up
+	uint16_t inPos;	// next byte in in[]
+	uint16_t inLen;	// bytes in in[]
+	uint16_t copyOffset;	// back-reference being expanded
+	uint16_t copyLeft;
+	uint16_t head;	// write position in window, wraps
+	char in[32];	// input read ahead from the image
+	char window[];
+} HeatshrinkDecoder;
+
 /*
 Available locations, at least in my flash, with boundaries partially guessed. This
 is using 0.9.1/0.9.2 SDK on a not-too-new module.
@@ -80,33 +113,122 @@ Accessing the flash through the mem emulation at 0x40200000 is a bit hairy: All
 a memory exception, crashing the program.
 */
 
-//Copies len bytes over from dst to src, but does it using *only*
-//aligned 32-bit reads. Yes, it's no too optimized but it's short and sweet and it works.
-
-//ToDo: perhaps os_memcpy also does unaligned accesses?
-#ifdef __ets__
+//Copies len bytes over from src to dst, but does it using *only* aligned 32-bit reads. Whole
+//words are copied as such, only the ragged bytes at the start and end need to be picked out
+//of a word. The destination is in RAM, so unaligned stores into it are done byte-wise.
+//The host build uses it too, so mkespfsimage -v exercises the same code.
 void ICACHE_FLASH_ATTR memcpyAligned(char *dst, const char *src, int len) {
-	int x;
-	int w, b;
-	for (x=0; x<len; x++) {
-		b=((int)src&3);
-		w=*((int *)(src-b));
-		if (b==0) *dst=(w>>0);
-		if (b==1) *dst=(w>>8);
-		if (b==2) *dst=(w>>16);
-		if (b==3) *dst=(w>>24);
-		dst++; src++;
+	uint32_t w;
+	int b=(uintptr_t)src&3;
+	if (b!=0 && len>0) {
+		//Head: the rest of the word src points into
+		w=*((uint32_t *)(src-b))>>(8*b);
+		src+=4-b;
+		for (b=4-b; b>0 && len>0; b--, len--) {
+			*dst++=w;
+			w>>=8;
+		}
+	}
+	if (((uintptr_t)dst&3)==0) {
+		for (; len>=4; len-=4) {
+			*((uint32_t *)dst)=*((uint32_t *)src);
+			dst+=4; src+=4;
+		}
+	} else {
+		for (; len>=4; len-=4) {
+			w=*((uint32_t *)src);
+			dst[0]=w; dst[1]=w>>8; dst[2]=w>>16; dst[3]=w>>24;
+			dst+=4; src+=4;
+		}
+	}
+	if (len>0) {
+		//Tail: the start of the last word
+		w=*((uint32_t *)src);
+		while (len--) {
+			*dst++=w;
+			w>>=8;
+		}
 	}
 }
-#else
-#define memcpyAligned memcpy
+
+#ifdef __ets__
+//Flash that isn't mapped (ESPFS_FLASH) is read through a small LRU cache of whole sectors, so
+//the headers and pages that get served over and over come from RAM. Each block takes 4KB of heap,
+//allocated on first use.
+#ifndef ESPFS_CACHE_BLOCKS
+#define ESPFS_CACHE_BLOCKS 2
 #endif
 
+typedef struct {
+	uint32_t addr;	// flash address of the block, -1 if it holds nothing
+	uint32_t lastUse;
+	char    *data;
+} EspFsBlock;
+
+static EspFsBlock blockCache[ESPFS_CACHE_BLOCKS];
+static uint32_t blockClock;
+static uint32_t blockHits, blockMisses;
+
+//Return the cached copy of the flash sector at addr, NULL if it can't be had
+static char ICACHE_FLASH_ATTR *espFsBlock(uint32_t addr) {
+	EspFsBlock *victim=&blockCache[0];
+	for (int i=0; i<ESPFS_CACHE_BLOCKS; i++) {
+		EspFsBlock *b=&blockCache[i];
+		if (b->data!=NULL && b->addr==addr) {
+			b->lastUse=++blockClock;
+			blockHits++;
+			return b->data;
+		}
+		//an empty slot is better than the least recently used one
+		if (victim->data!=NULL && (b->data==NULL || b->lastUse<victim->lastUse)) victim=b;
+	}
+	blockMisses++;
+	if (victim->data==NULL) {
+		victim->data=(char *)os_malloc(SPI_FLASH_SEC_SIZE);
+		if (victim->data==NULL) return NULL;
+	}
+	victim->addr=addr;
+	victim->lastUse=++blockClock;
+	if (spi_flash_read(addr, (uint32_t *)victim->data, SPI_FLASH_SEC_SIZE)!=SPI_FLASH_RESULT_OK) {
+		victim->addr=(uint32_t)-1;
+		return NULL;
+	}
+	return victim->data;
+}
+
+//Forget the cached flash contents, to be called when the flash gets rewritten
+void ICACHE_FLASH_ATTR espFsFlushCache(void) {
+	for (int i=0; i<ESPFS_CACHE_BLOCKS; i++) blockCache[i].addr=(uint32_t)-1;
+}
+
+//Report the block cache hits and misses since boot
+void ICACHE_FLASH_ATTR espFsCacheStats(uint32_t *hits, uint32_t *misses) {
+	*hits=blockHits;
+	*misses=blockMisses;
+}
+
 void ICACHE_FLASH_ATTR memcpyFromFlash(char *dst, const char *src, int len)
 {
-	if( spi_flash_read( (int)src, (void *)dst, len ) != SPI_FLASH_RESULT_OK )
-		os_memset( dst, 0, len ); // if read was not successful, reply with zeroes
+	uint32_t addr=(uint32_t)src;
+	while (len>0) {
+		uint32_t off=addr&(SPI_FLASH_SEC_SIZE-1);
+		int n=SPI_FLASH_SEC_SIZE-off;
+		if (n>len) n=len;
+		char *block=espFsBlock(addr-off);
+		if (block!=NULL) {
+			os_memcpy(dst, block+off, n);
+		} else if( spi_flash_read( addr, (void *)dst, n ) != SPI_FLASH_RESULT_OK ) {
+			os_memset( dst, 0, n ); // if read was not successful, reply with zeroes
+		}
+		dst+=n; addr+=n; len-=n;
+	}
 }
+#else
+//On the host there's no unmapped flash
+void espFsFlushCache(void) {}
+void espFsCacheStats(uint32_t *hits, uint32_t *misses) { *hits=*misses=0; }
+#define memcpyFromFlash memcpy
+#endif
 
 // memcpy on MEMORY/FLASH file systems
 void espfs_memcpy( EspFsContext * ctx, void * dest, const void * src, int count )
@@ -130,8 +252,12 @@ void espfs_memcpyAligned( EspFsContext * ctx, void * dest, const void * src, int
 EspFsInitResult ICACHE_FLASH_ATTR espFsInit(EspFsContext *ctx, void *flashAddress, EspFsSource source) {
 	ctx->valid = 0;
 	ctx->source = source;
+	if (source == ESPFS_FLASH) espFsFlushCache(); // the image may have been rewritten
+	os_memset(ctx->cache, 0, sizeof(ctx->cache));
+	ctx->cacheNext = 0;
+	ctx->index = NULL;
 	// base address must be aligned to 4 bytes
-	if (((int)flashAddress & 3) != 0) {
+	if (((uintptr_t)flashAddress & 3) != 0) {
 		return ESPFS_INIT_RESULT_BAD_ALIGN;
 	}
 
@@ -144,6 +270,21 @@ EspFsInitResult ICACHE_FLASH_ATTR espFsInit(EspFsContext *ctx, void *flashAddres
 
 	ctx->data = (char *)flashAddress;
 	ctx->valid = 1;
+
+	// images made by newer mkespfsimage start with an index
+	EspFsIndex index;
+	char *position = ctx->data + sizeof(EspFsHeader) + testHeader.nameLen;
+	if (!(testHeader.flags & FLAG_LASTFILE) && testHeader.nameLen == 4 &&
+			testHeader.fileLenComp >= sizeof(EspFsIndex)) {
+		char name[4];
+		espfs_memcpy(ctx, name, ctx->data + sizeof(EspFsHeader), 4);
+		espfs_memcpy(ctx, &index, position, sizeof(EspFsIndex));
+		if (name[0] == 0 && index.magic == ESPFS_INDEX_MAGIC && index.size > 0 &&
+				(index.size & (index.size-1)) == 0) {
+			ctx->index = position;
+			ctx->indexSize = index.size;
+		}
+	}
 	return ESPFS_INIT_RESULT_OK;
 }
 
@@ -156,11 +297,17 @@ int ICACHE_FLASH_ATTR espFsFlags(EspFsFile *fh) {
 		return -1;
 	}
 
-	int8_t flags;
+	uint8_t flags;
 	espfs_memcpyAligned(fh->ctx, (char*)&flags, (char*)&fh->header->flags, 1);
 	return (int)flags;
 }
 
+// Returns the index of the file's type in espFsMimeTypes, 0 if the image doesn't have it.
+int ICACHE_FLASH_ATTR espFsMime(EspFsFile *fh) {
+	if (fh == NULL) return 0;
+	return (espFsFlags(fh) & FLAG_MIME_MASK) >> FLAG_MIME_SHIFT;
+}
+
 // creates and initializes an iterator over the espfs file system
 void ICACHE_FLASH_ATTR espFsIteratorInit(EspFsContext *ctx, EspFsIterator *iterator)
 {
@@ -189,7 +336,7 @@ int ICACHE_FLASH_ATTR espFsIteratorNext(EspFsIterator *iterator)
 		// jump the iterator to the next file
 		
 		position+=sizeof(EspFsHeader) + iterator->header.nameLen+iterator->header.fileLenComp;
-		if ((int)position&3) position+=4-((int)position&3); //align to next 32bit val
+		if ((uintptr_t)position&3) position+=4-((uintptr_t)position&3); //align to next 32bit val
 	}
 	
 	iterator->position = position;
@@ -213,14 +360,146 @@ int ICACHE_FLASH_ATTR espFsIteratorNext(EspFsIterator *iterator)
 	//Grab the name of the file.
 	espfs_memcpy(iterator->ctx, iterator->name, position, sizeof(iterator->name));
 	
+	//The index isn't a file
+	if (iterator->name[0] == 0) return espFsIteratorNext(iterator);
 	return 1;
 }
 
+//Read the decoder parameters from the start of the file and set up the decoder.
+static HeatshrinkDecoder ICACHE_FLASH_ATTR *heatshrinkInit(EspFsFile *fh) {
+	uint8_t parm;
+	espfs_memcpyAligned(fh->ctx, (char*)&parm, fh->posComp, 1);
+	fh->posComp++;
+	int windowBits=parm>>4, lookaheadBits=parm&0xf;
+	if (windowBits<4 || windowBits>14 || lookaheadBits<3 || lookaheadBits>=windowBits) {
+#ifdef ESPFS_DBG
+		os_printf("Bad heatshrink parameters: %02x\n", parm);
+#endif
+		return NULL;
+	}
+	HeatshrinkDecoder *hs=(HeatshrinkDecoder *)os_malloc(sizeof(HeatshrinkDecoder)+(1<<windowBits));
+	if (hs==NULL) return NULL;
+	os_memset(hs, 0, sizeof(HeatshrinkDecoder)+(1<<windowBits));
+	hs->windowBits=windowBits;
+	hs->lookaheadBits=lookaheadBits;
+	return hs;
+}
+
+//Get the next count bits of compressed data, -1 at the end of the file.
+static int ICACHE_FLASH_ATTR heatshrinkBits(EspFsFile *fh, HeatshrinkDecoder *hs, int count, int flen) {
+	int r=0;
+	while (count--) {
+		if (hs->bitMask==0) {
+			if (hs->inPos==hs->inLen) {
+				int n=flen-(fh->posComp-fh->posStart);
+				if (n<=0) return -1;
+				if (n>sizeof(hs->in)) n=sizeof(hs->in);
+				espfs_memcpyAligned(fh->ctx, hs->in, fh->posComp, n);
+				fh->posComp+=n;
+				hs->inLen=n;
+				hs->inPos=0;
+			}
+			hs->bitByte=hs->in[hs->inPos++];
+			hs->bitMask=0x80;
+		}
+		r=(r<<1)|((hs->bitByte&hs->bitMask)?1:0);
+		hs->bitMask>>=1;
+	}
+	return r;
+}
+
+//Decompress up to len bytes into buff, returns the number of bytes produced.
+static int ICACHE_FLASH_ATTR heatshrinkRead(EspFsFile *fh, char *buff, int len, int flen) {
+	HeatshrinkDecoder *hs=(HeatshrinkDecoder *)fh->decompData;
+	uint16_t mask=(1<<hs->windowBits)-1;
+	int n=0;
+	while (n<len) {
+		if (hs->copyLeft==0) {
+			int tag=heatshrinkBits(fh, hs, 1, flen);
+			if (tag<0) break;
+			if (tag) {
+				int c=heatshrinkBits(fh, hs, 8, flen);
+				if (c<0) break;
+				hs->window[hs->head++ & mask]=c;
+				buff[n++]=c;
+				continue;
+			}
+			int offset=heatshrinkBits(fh, hs, hs->windowBits, flen);
+			int count=heatshrinkBits(fh, hs, hs->lookaheadBits, flen);
+			if (offset<0 || count<0) break;
+			hs->copyOffset=offset+1;
+			hs->copyLeft=count+1;
+		}
+		char c=hs->window[(uint16_t)(hs->head-hs->copyOffset) & mask];
+		hs->window[hs->head++ & mask]=c;
+		buff[n++]=c;
+		hs->copyLeft--;
+	}
+	return n;
+}
+
+//Set up a file descriptor for the file with header h at position.
+static EspFsFile ICACHE_FLASH_ATTR *espFsOpenHeader(EspFsContext *ctx, char *position, EspFsHeader *h) {
+	EspFsFile * r=(EspFsFile *)os_malloc(sizeof(EspFsFile)); //Alloc file desc mem
+	//os_printf("Alloc %p[%d]\n", r, sizeof(EspFsFile));
+	if (r==NULL) return NULL;
+	r->ctx = ctx;
+	r->header=(EspFsHeader *)position;
+	r->decompressor=h->compression;
+	r->posComp=position + h->nameLen + sizeof(EspFsHeader);
+	r->posStart=position + h->nameLen + sizeof(EspFsHeader);
+	r->posDecomp=0;
+	if (h->compression==COMPRESS_NONE) {
+		r->decompData=NULL;
+	} else if (h->compression==COMPRESS_LINK) {
+		//Open the file this one shares its data with instead
+		uint32_t dist;
+		EspFsHeader lh;
+		espfs_memcpyAligned(ctx, (char*)&dist, r->posStart, 4);
+		os_free(r);
+		position-=dist;
+		espfs_memcpy(ctx, &lh, position, sizeof(EspFsHeader));
+		if (lh.magic!=ESPFS_MAGIC || lh.compression==COMPRESS_LINK) return NULL;
+		return espFsOpenHeader(ctx, position, &lh);
+	} else if (h->compression==COMPRESS_HEATSHRINK) {
+		r->decompData=heatshrinkInit(r);
+		if (r->decompData==NULL) {
+			os_free(r);
+			return NULL;
+		}
+	} else {
+#ifdef ESPFS_DBG
+		os_printf("Invalid compression: %d\n", h->compression);
+#endif
+		os_free(r);
+		return NULL;
+	}
+	return r;
+}
+
+//Open the file with its header at position if it's called fileName.
+static EspFsFile ICACHE_FLASH_ATTR *espFsOpenAt(EspFsContext *ctx, char *position, char *fileName) {
+	EspFsHeader h;
+	char name[256];
+	espfs_memcpy(ctx, &h, position, sizeof(EspFsHeader));
+	if (h.magic!=ESPFS_MAGIC || (h.flags&FLAG_LASTFILE) || h.nameLen<=0 || h.nameLen>sizeof(name))
+		return NULL;
+	espfs_memcpy(ctx, name, position + sizeof(EspFsHeader), h.nameLen);
+	name[h.nameLen-1]=0;
+	if (os_strcmp(name, fileName)!=0) return NULL;
+	return espFsOpenHeader(ctx, position, &h);
+}
+
+static void ICACHE_FLASH_ATTR espFsCacheAdd(EspFsContext *ctx, uint32_t hash, char *position) {
+	ctx->cache[ctx->cacheNext].hash=hash;
+	ctx->cache[ctx->cacheNext].position=position;
+	ctx->cacheNext=(ctx->cacheNext+1)%ESPFS_CACHE_SIZE;
+}
+
 //Open a file and return a pointer to the file desc struct.
 EspFsFile ICACHE_FLASH_ATTR *espFsOpen(EspFsContext *ctx, char *fileName) {
-	EspFsIterator it;
-	espFsIteratorInit(ctx, &it);
-	if (it.ctx == NULL) {
+	EspFsFile *r;
+	if (ctx->data==NULL) {
 #ifdef ESPFS_DBG
 		os_printf("Call espFsInit first!\n");
 #endif
@@ -228,30 +507,43 @@ EspFsFile ICACHE_FLASH_ATTR *espFsOpen(EspFsContext *ctx, char *fileName) {
 	}
 	//Strip initial slashes
 	while(fileName[0]=='/') fileName++;
-	
-	//Search the file
+	if (fileName[0]==0) return NULL; //that's the index
+
+	uint32_t hash=espFsHash(fileName);
+	for (int i=0; i<ESPFS_CACHE_SIZE; i++) {
+		if (ctx->cache[i].position!=NULL && ctx->cache[i].hash==hash) {
+			r=espFsOpenAt(ctx, ctx->cache[i].position, fileName);
+			if (r!=NULL) return r;
+		}
+	}
+
+	if (ctx->index!=NULL) {
+		//Look the name up in the index, a free slot means it's not there
+		uint32_t mask=ctx->indexSize-1;
+		char *slots=ctx->index + sizeof(EspFsIndex);
+		for (uint32_t i=hash&mask, n=0; n<ctx->indexSize; i=(i+1)&mask, n++) {
+			EspFsIndexEntry e;
+			espfs_memcpyAligned(ctx, (char*)&e, slots + i*sizeof(EspFsIndexEntry), sizeof(EspFsIndexEntry));
+			if (e.offset==0) break;
+			if (e.hash!=hash) continue;
+			r=espFsOpenAt(ctx, ctx->data + e.offset, fileName);
+			if (r!=NULL) {
+				espFsCacheAdd(ctx, hash, ctx->data + e.offset);
+				return r;
+			}
+		}
+		return NULL;
+	}
+
+	//No index, search the file
+	EspFsIterator it;
+	espFsIteratorInit(ctx, &it);
 	while( espFsIteratorNext(&it) ) 
 	{
 		if (os_strcmp(it.name, fileName)==0) {
 			//Yay, this is the file we need!
-			EspFsFile * r=(EspFsFile *)os_malloc(sizeof(EspFsFile)); //Alloc file desc mem
-			//os_printf("Alloc %p[%d]\n", r, sizeof(EspFsFile));
-			if (r==NULL) return NULL;
-			r->ctx = ctx;
-			r->header=(EspFsHeader *)it.position;
-			r->decompressor=it.header.compression;
-			r->posComp=it.position + it.header.nameLen  + sizeof(EspFsHeader);
-			r->posStart=it.position + it.header.nameLen  + sizeof(EspFsHeader);
-			r->posDecomp=0;
-			if (it.header.compression==COMPRESS_NONE) {
-				r->decompData=NULL;
-			} else {
-#ifdef ESPFS_DBG
-				os_printf("Invalid compression: %d\n", h.compression);
-#endif
-				return NULL;
-			}
-			return r;
+			espFsCacheAdd(ctx, hash, it.position);
+			return espFsOpenHeader(ctx, it.position, &it.header);
 		}
 	}
 	return NULL;
@@ -275,13 +567,43 @@ int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 		fh->posComp+=len;
 //		os_printf("Done reading %d bytes, pos=%x\n", len, fh->posComp);
 		return len;
+	} else if (fh->decompressor==COMPRESS_HEATSHRINK) {
+		//The bit stream is padded out to a byte, so stop at the known decompressed length
+		if (len>fdlen-fh->posDecomp) len=fdlen-fh->posDecomp;
+		len=heatshrinkRead(fh, buff, len, flen);
+		fh->posDecomp+=len;
+		return len;
 	}
 	return 0;
 }
 
+//Return the length of the data espFsRead hands out. That's the decompressed length for
+//heatshrink, but gzipped files go out as stored, so theirs is the stored length.
+int ICACHE_FLASH_ATTR espFsSize(EspFsFile *fh) {
+	int len;
+	if (fh==NULL) return 0;
+	if (fh->decompressor==COMPRESS_NONE)
+		espfs_memcpyAligned(fh->ctx, (char*)&len, (char*)&fh->header->fileLenComp, 4);
+	else
+		espfs_memcpyAligned(fh->ctx, (char*)&len, (char*)&fh->header->fileLenDecomp, 4);
+	return len;
+}
+
+//Move the read position to the given offset from the start of the file.
+//Returns 0 on success, -1 if the offset is out of range or the file can't be seeked
+//(compressed files only read sequentially).
+int ICACHE_FLASH_ATTR espFsSeek(EspFsFile *fh, int offset) {
+	if (fh==NULL || fh->decompressor!=COMPRESS_NONE) return -1;
+	if (offset<0 || offset>espFsSize(fh)) return -1;
+	fh->posComp=fh->posStart+offset;
+	fh->posDecomp=offset;
+	return 0;
+}
+
 //Close the file.
 void ICACHE_FLASH_ATTR espFsClose(EspFsFile *fh) {
 	if (fh==NULL) return;
+	if (fh->decompData!=NULL) os_free(fh->decompData);
 	//os_printf("Freed %p\n", fh);
 	os_free(fh);
 }
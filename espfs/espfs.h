@@ -33,8 +33,13 @@ EspFsInitResult espFsInit(EspFsContext *ctx, void *flashAddress, EspFsSource sou
 EspFsFile *espFsOpen(EspFsContext *ctx, char *fileName);
 int espFsIsValid(EspFsContext *ctx);
 int espFsFlags(EspFsFile *fh);
+int espFsMime(EspFsFile *fh);
 int espFsRead(EspFsFile *fh, char *buff, int len);
+int espFsSize(EspFsFile *fh);
+int espFsSeek(EspFsFile *fh, int offset);
 void espFsClose(EspFsFile *fh);
+void espFsFlushCache(void);
+void espFsCacheStats(uint32_t *hits, uint32_t *misses);
 
 void espFsIteratorInit(EspFsContext *ctx, EspFsIterator *iterator);
 int espFsIteratorNext(EspFsIterator *iterator);
@@ -17,8 +17,14 @@ with the FLAG_LASTFILE flag set.
 
 #define FLAG_LASTFILE (1<<0)
 #define FLAG_GZIP (1<<1)
+//The upper bits of the flags hold the index of the file's type in espFsMimeTypes (espfsmime.h)
+#define FLAG_MIME_SHIFT 2
+#define FLAG_MIME_MASK (0x3f<<FLAG_MIME_SHIFT)
 #define COMPRESS_NONE 0
 #define COMPRESS_HEATSHRINK 1
+//The file has the same data as an earlier one: its data is the distance back to that file's
+//header (4 bytes), which has the lengths and the compression.
+#define COMPRESS_LINK 2
 #define ESPFS_MAGIC 0x73665345
 
 typedef struct {
@@ -30,4 +36,32 @@ typedef struct {
 	int32_t fileLenDecomp;
 } __attribute__((packed)) EspFsHeader;
 
+/*
+mkespfsimage puts an index in front of the files so they can be found without walking all the
+headers. It is stored as a file with an empty name (older firmware never opens it) holding an
+EspFsIndex followed by a hash table of EspFsIndexEntry. Files go into the slot given by the low
+bits of espFsHash(name), or the next free one after it. An offset of 0 marks a free slot.
+*/
+#define ESPFS_INDEX_MAGIC 0x78644945
+
+typedef struct {
+	int32_t magic;
+	int32_t size;	// number of slots, a power of 2
+} __attribute__((packed)) EspFsIndex;
+
+typedef struct {
+	uint32_t hash;
+	uint32_t offset;	// of the file's header from the start of the image
+} __attribute__((packed)) EspFsIndexEntry;
+
+//FNV-1a hash of a file name as stored in the image (without leading slash)
+static inline uint32_t espFsHash(const char *name) {
+	uint32_t h=2166136261u;
+	while (*name) {
+		h^=(uint8_t)*name++;
+		h*=16777619u;
+	}
+	return h;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,56 @@
+#ifndef ESPFSMIME_H
+#define ESPFSMIME_H
+
+/*
+MIME types of the files in an espfs image. mkespfsimage looks up the type of each file when
+building the image and stores its index in the header flags (see FLAG_MIME_SHIFT), so httpd
+never has to match file extensions when serving it. Index 0 means the type wasn't resolved
+(older images), the url is matched against the table then.
+
+The indices are part of the image format: only ever append to this list.
+*/
+
+typedef struct {
+	const char *ext;
+	const char *mimetype;
+} EspFsMimeType;
+
+#define ESPFS_MIME_DEFAULT "text/html"
+
+static const EspFsMimeType espFsMimeTypes[] = {
+	{ NULL, NULL },
+	{ "htm", "text/html; charset=UTF-8" },
+	{ "html", "text/html; charset=UTF-8" },
+	{ "css", "text/css" },
+	{ "js", "text/javascript" },
+	{ "txt", "text/plain" },
+	{ "jpg", "image/jpeg" },
+	{ "jpeg", "image/jpeg" },
+	{ "png", "image/png" },
+	{ "tpl", "text/html; charset=UTF-8" },
+	{ "json", "application/json" },
+	{ "svg", "image/svg+xml" },
+	{ "ico", "image/x-icon" },
+	{ "gif", "image/gif" },
+	{ "bmp", "image/bmp" },
+	{ "webp", "image/webp" },
+	{ "woff", "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "ttf", "font/ttf" },
+	{ "otf", "font/otf" },
+	{ "xml", "text/xml" },
+	{ "csv", "text/csv" },
+	{ "map", "application/json" },
+	{ "pdf", "application/pdf" },
+	{ "gz", "application/gzip" },
+	{ "zip", "application/zip" },
+	{ "bin", "application/octet-stream" },
+	{ "mp3", "audio/mpeg" },
+	{ "wav", "audio/wav" },
+	{ "mp4", "video/mp4" },
+	{ "wasm", "application/wasm" },
+};
+
+#define ESPFS_MIME_COUNT (sizeof(espFsMimeTypes)/sizeof(EspFsMimeType))
+
+#endif
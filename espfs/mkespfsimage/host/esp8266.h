@@ -0,0 +1,27 @@
+// Stand-in for the SDK's esp8266.h so httpdespfs.c also builds into mkespfsimage, see httpdhost.c
+#ifndef _ESP8266_H_
+#define _ESP8266_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint32_t uint32;
+struct espconn;
+
+#define ICACHE_FLASH_ATTR
+#define os_malloc malloc
+#define os_free free
+#define os_memcpy memcpy
+#define os_memset memset
+#define os_strlen strlen
+#define os_strcmp strcmp
+#define os_strncmp strncmp
+#define os_strchr strchr
+#define os_strstr strstr
+#define os_strcpy strcpy
+#define os_sprintf sprintf
+#define os_printf printf
+
+#endif
@@ -0,0 +1,116 @@
+//Just enough of httpd to run httpdespfs.c on the host, so mkespfsimage -v can check what a
+//browser gets served from an image: the request headers come from a string and the response
+//ends up in a buffer.
+
+#include <esp8266.h>
+#include "httpd.h"
+#include "httpdespfs.h"
+#include "espfsmime.h"
+
+#define HOST_SENDBUFF_LEN (2*1460)
+
+struct HttpdPriv {
+	const char *head;	// request headers, "Name: value\r\n" lines
+	char *out;	// response so far
+	int len, max;
+};
+
+//Make room for n more bytes of response
+static char *reserve(HttpdConnData *conn, int n) {
+	HttpdPriv *p=conn->priv;
+	if (p->len+n>p->max) {
+		while (p->len+n>p->max) p->max=p->max ? p->max*2 : 4096;
+		p->out=realloc(p->out, p->max);
+	}
+	return p->out+p->len;
+}
+
+int httpdSend(HttpdConnData *conn, const char *data, int len) {
+	if (len<0) len=strlen(data);
+	memcpy(reserve(conn, len), data, len);
+	conn->priv->len+=len;
+	return 1;
+}
+
+char *httpdSendBuffer(HttpdConnData *conn, int *len) {
+	*len=HOST_SENDBUFF_LEN;
+	return reserve(conn, HOST_SENDBUFF_LEN);
+}
+
+void httpdSendCommit(HttpdConnData *conn, int len) {
+	conn->priv->len+=len;
+}
+
+void httpdStartResponse(HttpdConnData *conn, int code) {
+	char buff[32];
+	sprintf(buff, "HTTP/1.0 %d OK\r\n", code);
+	httpdSend(conn, buff, -1);
+}
+
+void httpdHeader(HttpdConnData *conn, const char *field, const char *val) {
+	httpdSend(conn, field, -1);
+	httpdSend(conn, ": ", 2);
+	httpdSend(conn, val, -1);
+	httpdSend(conn, "\r\n", 2);
+}
+
+void httpdEndHeaders(HttpdConnData *conn) {
+	httpdSend(conn, "\r\n", 2);
+}
+
+int httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen) {
+	const char *p=conn->priv->head;
+	int n=strlen(header);
+	while (p!=NULL && *p!=0) {
+		if (strncmp(p, header, n)==0 && p[n]==':') {
+			p+=n+1;
+			while (*p==' ') p++;
+			while (*p!=0 && *p!='\r' && *p!='\n' && retLen>1) {
+				*ret++=*p++;
+				retLen--;
+			}
+			*ret=0;
+			return 1;
+		}
+		p=strchr(p, '\n');
+		if (p!=NULL) p++;
+	}
+	return 0;
+}
+
+int httpdUrlDecode(char *val, int valLen, char *ret, int retLen) {
+	int n=valLen<retLen-1 ? valLen : retLen-1;
+	memcpy(ret, val, n);
+	ret[n]=0;
+	return n;
+}
+
+const char *httpdMimetypeByIndex(int idx) {
+	if (idx<=0 || idx>=ESPFS_MIME_COUNT) return ESPFS_MIME_DEFAULT;
+	return espFsMimeTypes[idx].mimetype;
+}
+
+const char *httpdGetMimetype(char *url) {
+	return ESPFS_MIME_DEFAULT;
+}
+
+//GET url through cgiEspFsHook with the given request headers. Returns the length of the
+//response, which is left in a malloc'd buffer at *resp, or -1 if the file isn't found.
+int httpdHostGet(char *url, const char *head, char **resp) {
+	static char conn;
+	HttpdPriv priv={ head, NULL, 0, 0 };
+	HttpdConnData cd;
+	memset(&cd, 0, sizeof(cd));
+	cd.conn=(struct espconn *)&conn;
+	cd.url=url;
+	cd.priv=&priv;
+	int r;
+	while ((r=cgiEspFsHook(&cd))==HTTPD_CGI_MORE) ;
+	*resp=priv.out;
+	if (r==HTTPD_CGI_NOTFOUND) {
+		free(priv.out);
+		*resp=NULL;
+		return -1;
+	}
+	return priv.len;
+}
@@ -18,6 +18,12 @@
 #include <arpa/inet.h>
 #endif
 #include "espfsformat.h"
+#include "espfsmime.h"
+
+#ifndef __WIN32__
+#include <pthread.h>
+#endif
+#include <time.h>
 
 //Gzip
 #ifdef ESPFS_GZIP
@@ -53,9 +59,9 @@ size_t compressGzip(char *in, int insize, char *out, int outsize, int level) {
 	stream.zalloc = Z_NULL;
 	stream.zfree  = Z_NULL;
 	stream.opaque = Z_NULL;
-	stream.next_in = in;
+	stream.next_in = (Bytef *)in;
 	stream.avail_in = insize;
-	stream.next_out = out;
+	stream.next_out = (Bytef *)out;
 	stream.avail_out = outsize;
 	// 31 -> 15 window bits + 16 for gzip
 	zresult = deflateInit2 (&stream, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
@@ -130,26 +136,169 @@ int parseGzipExtensions(char *input) {
 }
 #endif
 
-int handleFile(int f, char *name, int compression, int level, char **compName, off_t *csizePtr) {
+//Heatshrink compression, see the decoder in espfs.c for the format. A plain greedy LZSS encoder,
+//with hash chains to find matches.
+#define HS_HASH_SIZE 4096
+#define HS_MAX_CHAIN 256
+
+typedef struct {
+	char *out;
+	int len, max;
+	uint8_t cur;	// byte being filled
+	int bits;	// bits in cur
+} BitWriter;
+
+void putBits(BitWriter *w, int val, int count) {
+	while (count--) {
+		w->cur=(w->cur<<1)|((val>>count)&1);
+		if (++w->bits==8) {
+			if (w->len<w->max) w->out[w->len]=w->cur;
+			w->len++;
+			w->cur=0;
+			w->bits=0;
+		}
+	}
+}
+
+int hsHash(unsigned char *p) {
+	return ((p[0]<<8)^(p[1]<<4)^p[2])&(HS_HASH_SIZE-1);
+}
+
+//Returns the compressed size, which is larger than outsize if it didn't fit.
+size_t compressHeatshrink(char *in, int insize, char *out, int outsize, int level) {
+	//The decoder needs 2^windowBits bytes of RAM, so go easy on it by default
+	if (level==-1) level=6;
+	int windowBits=8+(level-1)/2;	//256 bytes to 4KB
+	int lookaheadBits=4;
+	int window=1<<windowBits, maxLen=1<<lookaheadBits;
+	//A back-reference has to be shorter than the literals it replaces
+	int minLen=(1+windowBits+lookaheadBits)/9+1;
+	unsigned char *data=(unsigned char *)in;
+	int *head=malloc(HS_HASH_SIZE*sizeof(int));
+	int *prev=malloc((insize+1)*sizeof(int));
+	BitWriter w={out, 0, outsize, 0, 0};
+
+	for (int i=0; i<HS_HASH_SIZE; i++) head[i]=-1;
+	putBits(&w, (windowBits<<4)|lookaheadBits, 8);
+	int pos=0;
+	while (pos<insize) {
+		int bestLen=0, bestOff=0;
+		if (pos+2<insize) {
+			int chain=HS_MAX_CHAIN;
+			for (int c=head[hsHash(data+pos)]; c>=0 && pos-c<=window && chain--; c=prev[c]) {
+				int l=0;
+				while (l<maxLen && pos+l<insize && data[c+l]==data[pos+l]) l++;
+				if (l>bestLen) {
+					bestLen=l;
+					bestOff=pos-c;
+					if (l==maxLen) break;
+				}
+			}
+		}
+		int step=1;
+		if (bestLen>=minLen) {
+			putBits(&w, 0, 1);
+			putBits(&w, bestOff-1, windowBits);
+			putBits(&w, bestLen-1, lookaheadBits);
+			step=bestLen;
+		} else {
+			putBits(&w, 1, 1);
+			putBits(&w, data[pos], 8);
+		}
+		//Add the positions we're moving past to the hash chains
+		while (step--) {
+			if (pos+2<insize) {
+				int h=hsHash(data+pos);
+				prev[pos]=head[h];
+				head[h]=pos;
+			}
+			pos++;
+		}
+	}
+	if (w.bits) putBits(&w, 0, 8-w.bits);	//pad out the last byte
+	free(head);
+	free(prev);
+	return w.len;
+}
+
+//The image is put together in memory so the index can go in front of the files
+char *image;
+size_t imageLen, imageMax;
+int numFiles;
+uint32_t *fileHash, *fileOffset;
+
+void emit(const void *data, size_t len) {
+	if (imageLen+len>imageMax) {
+		imageMax=(imageLen+len)*2;
+		image=realloc(image, imageMax);
+		if (image==NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	memcpy(image+imageLen, data, len);
+	imageLen+=len;
+}
+
+//Look up the index of the file's type in espFsMimeTypes, 0 if the extension isn't known
+int mimeIndex(char *name) {
+	char *ext = strrchr(name, '.');
+	if (ext == NULL) return 0;
+	for (int i=1; i<ESPFS_MIME_COUNT; i++) {
+		if (strcasecmp(ext+1, espFsMimeTypes[i].ext) == 0) return i;
+	}
+	return 0;
+}
+
+//A file going into the image. Files are compressed in parallel, then written out one by one
+//in name order so the same input always gives the same image.
+typedef struct {
+	char *path;	// as read from stdin
+	char *name;	// as stored in the image
 	char *fdat, *cdat;
 	off_t size, csize;
-	EspFsHeader h;
-	int nameLen;
+	int compression;
+	int8_t flags;
+	int ok;
+	int dupOf;	// earlier file with the same data, -1 if none
+	uint32_t offset;	// of its header in the image, once emitted
+} FileJob;
+
+FileJob *jobs;
+int numJobs;
+int compType=COMPRESS_NONE;
+int compLvl=-1;
+
+//Read and compress one file
+void handleFile(FileJob *job) {
+	char *fdat, *cdat;
+	off_t size, csize;
+	int compression=compType;
 	int8_t flags = 0;
+	int f=open(job->path, O_RDONLY);
+	if (f<0) {
+		perror(job->path);
+		return;
+	}
 	size=lseek(f, 0, SEEK_END);
-	fdat=mmap(NULL, size, PROT_READ, MAP_SHARED, f, 0);
-	if (fdat==MAP_FAILED) {
-		perror("mmap");
-		return 0;
+	fdat=NULL;
+	if (size>0) {
+		fdat=mmap(NULL, size, PROT_READ, MAP_SHARED, f, 0);
+		if (fdat==MAP_FAILED) {
+			perror("mmap");
+			close(f);
+			return;
+		}
 	}
+	close(f);
 
 #ifdef ESPFS_GZIP
-	if (shouldCompressGzip(name)) {
+	if (shouldCompressGzip(job->name)) {
 		csize = size*3;
 		if (csize<100) // gzip has some headers that do not fit when trying to compress small files
 			csize = 100; // enlarge buffer if this is the case
 		cdat=malloc(csize);
-		csize=compressGzip(fdat, size, cdat, csize, level);
+		csize=compressGzip(fdat, size, cdat, csize, compLvl);
 		compression = COMPRESS_NONE;
 		flags = FLAG_GZIP;
 	} else
@@ -157,6 +306,11 @@ int handleFile(int f, char *name, int compression, int level, char **compName, o
 	if (compression==COMPRESS_NONE) {
 		csize=size;
 		cdat=fdat;
+	} else if (compression==COMPRESS_HEATSHRINK) {
+		//Worst case is 9 bits per byte plus the parameter byte
+		csize=size+size/8+2;
+		cdat=malloc(csize);
+		csize=compressHeatshrink(fdat, size, cdat, csize, compLvl);
 	} else {
 		fprintf(stderr, "Unknown compression - %d\n", compression);
 		exit(1);
@@ -164,49 +318,120 @@ int handleFile(int f, char *name, int compression, int level, char **compName, o
 
 	if (csize>size) {
 		//Compressing enbiggened this file. Revert to uncompressed store.
+		if (cdat!=fdat) free(cdat);
 		compression=COMPRESS_NONE;
 		csize=size;
 		cdat=fdat;
 		flags=0;
 	}
 
+	job->fdat=fdat;
+	job->cdat=cdat;
+	job->size=size;
+	job->csize=csize;
+	job->compression=compression;
+	job->flags=flags|(mimeIndex(job->name)<<FLAG_MIME_SHIFT);
+	job->ok=1;
+}
+
+#ifndef __WIN32__
+//Worker threads take the next file off the list until there are none left
+pthread_mutex_t jobLock=PTHREAD_MUTEX_INITIALIZER;
+int nextJob;
+
+void *compressWorker(void *arg) {
+	while (1) {
+		pthread_mutex_lock(&jobLock);
+		int j=nextJob++;
+		pthread_mutex_unlock(&jobLock);
+		if (j>=numJobs) return NULL;
+		handleFile(&jobs[j]);
+	}
+}
+#endif
+
+void compressAll(int threads) {
+#ifndef __WIN32__
+	if (threads>numJobs) threads=numJobs;
+	if (threads>1) {
+		pthread_t *tid=malloc(threads*sizeof(pthread_t));
+		nextJob=0;
+		for (int i=0; i<threads; i++) pthread_create(&tid[i], NULL, compressWorker, NULL);
+		for (int i=0; i<threads; i++) pthread_join(tid[i], NULL);
+		free(tid);
+		return;
+	}
+#endif
+	for (int i=0; i<numJobs; i++) handleFile(&jobs[i]);
+}
+
+char *compressionName(FileJob *job) {
+	if (job->compression==COMPRESS_NONE) return (job->flags & FLAG_GZIP) ? "gzip" : "none";
+	if (job->compression==COMPRESS_HEATSHRINK) return "heatshrink";
+	return "unknown";
+}
+
+//Add a file to the image. A file with the same stored data and flags as an earlier one only
+//gets a header that refers to the earlier one's.
+void emitFile(int j) {
+	FileJob *job=&jobs[j];
+	EspFsHeader h;
+	int nameLen;
+	off_t csize=job->csize;
+	uint32_t link;
+
+	job->dupOf=-1;
+	for (int i=0; i<j; i++) {
+		FileJob *o=&jobs[i];
+		if (o->ok && o->dupOf<0 && o->csize==job->csize && o->flags==job->flags &&
+				o->compression==job->compression && memcmp(o->cdat, job->cdat, csize)==0) {
+			job->dupOf=i;
+			break;
+		}
+	}
+
 	//Fill header data
 	h.magic=('E'<<0)+('S'<<8)+('f'<<16)+('s'<<24);
-	h.flags=flags;
-	h.compression=compression;
-	h.nameLen=nameLen=strlen(name)+1;
+	h.flags=job->flags;
+	h.compression=job->compression;
+	h.nameLen=nameLen=strlen(job->name)+1;
 	if (h.nameLen&3) h.nameLen+=4-(h.nameLen&3); //Round to next 32bit boundary
 	h.nameLen=htoxs(h.nameLen);
 	h.fileLenComp=htoxl(csize);
-	h.fileLenDecomp=htoxl(size);
+	h.fileLenDecomp=htoxl(job->size);
+	if (job->dupOf>=0) {
+		h.compression=COMPRESS_LINK;
+		h.fileLenComp=htoxl(sizeof(link));
+		link=htoxl(imageLen-jobs[job->dupOf].offset);
+	}
 
-	write(1, &h, sizeof(EspFsHeader));
-	write(1, name, nameLen);
+	fileHash=realloc(fileHash, (numFiles+1)*sizeof(uint32_t));
+	fileOffset=realloc(fileOffset, (numFiles+1)*sizeof(uint32_t));
+	fileHash[numFiles]=espFsHash(job->name);
+	fileOffset[numFiles]=imageLen;
+	job->offset=imageLen;
+	numFiles++;
+
+	emit(&h, sizeof(EspFsHeader));
+	emit(job->name, nameLen);
 	while (nameLen&3) {
-		write(1, "\000", 1);
+		emit("\000", 1);
 		nameLen++;
 	}
-	write(1, cdat, csize);
+	if (job->dupOf>=0) {
+		emit(&link, sizeof(link));
+		return;
+	}
+	emit(job->cdat, csize);
 	//Pad out to 32bit boundary
 	while (csize&3) {
-		write(1, "\000", 1);
+		emit("\000", 1);
 		csize++;
 	}
-	munmap(fdat, size);
+}
 
-	if (compName != NULL) {
-		if (h.compression==COMPRESS_NONE) {
-			if (h.flags & FLAG_GZIP) {
-				*compName = "gzip";
-			} else {
-				*compName = "none";
-			}
-		} else {
-			*compName = "unknown";
-		}
-	}
-  *csizePtr = csize;
-	return (csize*100)/size;
+int compareJobs(const void *a, const void *b) {
+	return strcmp(((FileJob *)a)->name, ((FileJob *)b)->name);
 }
 
 //Write final dummy header with FLAG_LASTFILE set.
@@ -218,21 +443,256 @@ void finishArchive() {
 	h.nameLen=htoxs(0);
 	h.fileLenComp=htoxl(0);
 	h.fileLenDecomp=htoxl(0);
+	emit(&h, sizeof(EspFsHeader));
+}
+
+//Write the index followed by the files. The hash table is kept at most half full so lookups
+//rarely need more than a probe or two.
+int writeImage() {
+	EspFsHeader h;
+	EspFsIndex index;
+	int size=1;
+	while (size<2*numFiles) size*=2;
+	int indexLen=sizeof(EspFsHeader)+4+sizeof(EspFsIndex)+size*sizeof(EspFsIndexEntry);
+	EspFsIndexEntry *slots=calloc(size, sizeof(EspFsIndexEntry));
+	for (int i=0; i<numFiles; i++) {
+		int s=fileHash[i]&(size-1);
+		while (slots[s].offset!=0) s=(s+1)&(size-1);
+		slots[s].hash=htoxl(fileHash[i]);
+		slots[s].offset=htoxl(fileOffset[i]+indexLen);
+	}
+
+	h.magic=('E'<<0)+('S'<<8)+('f'<<16)+('s'<<24);
+	h.flags=0;
+	h.compression=COMPRESS_NONE;
+	h.nameLen=htoxs(4);
+	h.fileLenComp=htoxl(indexLen-sizeof(EspFsHeader)-4);
+	h.fileLenDecomp=h.fileLenComp;
+	index.magic=htoxl(ESPFS_INDEX_MAGIC);
+	index.size=htoxl(size);
 	write(1, &h, sizeof(EspFsHeader));
+	write(1, "\000\000\000\000", 4);
+	write(1, &index, sizeof(EspFsIndex));
+	write(1, slots, size*sizeof(EspFsIndexEntry));
+	write(1, image, imageLen);
+	free(slots);
+	return indexLen+imageLen;
+}
+
+#ifdef ESPFS_GZIP
+//Unpack a gzipped file from the image, returns the unpacked size
+size_t decompressGzip(char *in, int insize, char *out, int outsize) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	stream.next_in = (Bytef *)in;
+	stream.avail_in = insize;
+	stream.next_out = (Bytef *)out;
+	stream.avail_out = outsize;
+	if (inflateInit2(&stream, 31) != Z_OK) return 0;
+	inflate(&stream, Z_FINISH);
+	inflateEnd(&stream);
+	return stream.total_out;
+}
+#endif
+
+double now() {
+	return (double)clock()/CLOCKS_PER_SEC;
+}
+
+//From espfs.c and httpdhost.c
+void memcpyAligned(char *dst, const char *src, int len);
+int httpdHostGet(char *url, const char *head, char **resp);
+
+//memcpyAligned must give the same bytes as memcpy for any alignment of source, destination and
+//length, without touching the destination past len. Returns the number of mismatches.
+int checkMemcpyAligned() {
+	uint32_t srcWords[20], dstWords[20];
+	char *src=(char *)srcWords, *dst=(char *)dstWords, ref[sizeof(dstWords)];
+	int errors=0;
+	for (int i=0; i<sizeof(srcWords); i++) src[i]=i*7+1;
+	for (int s=0; s<4; s++) for (int d=0; d<4; d++) for (int len=0; len<=64; len++) {
+		memset(dst, 0xa5, sizeof(dstWords));
+		memset(ref, 0xa5, sizeof(ref));
+		memcpy(ref+d, src+s, len);
+		memcpyAligned(dst+d, src+s, len);
+		if (memcmp(dst, ref, sizeof(ref))!=0) {
+			fprintf(stderr, "memcpyAligned: wrong copy with src+%d, dst+%d, len %d\n", s, d, len);
+			errors++;
+		}
+	}
+	return errors;
+}
+
+//Fetch a file the way the firmware serves it, through httpdespfs.c, and check the response
+//against what is stored in the image: headers, Content-Length and a byte range.
+int checkServed(FileJob *job, char *stored, int size, int gzip) {
+	char url[1024], *resp, *body;
+	int errors=0, len, n;
+	snprintf(url, sizeof(url), "/%s", job->name);
+
+	len=httpdHostGet(url, "Accept-Encoding: gzip, deflate\r\n", &resp);
+	body=len>0 ? strstr(resp, "\r\n\r\n") : NULL;
+	if (body==NULL) {
+		fprintf(stderr, "%s: not served\n", job->name);
+		free(resp);
+		return 1;
+	}
+	body+=4;
+	n=len-(body-resp);
+	char *cl=strstr(resp, "Content-Length: ");
+	if (cl==NULL || cl>body || atoi(cl+16)!=n) {
+		fprintf(stderr, "%s: Content-Length doesn't match the %d bytes sent\n", job->name, n);
+		errors++;
+	}
+	if (n!=size || memcmp(body, stored, n)!=0) {
+		fprintf(stderr, "%s: served %d bytes that differ from the %d stored\n", job->name, n, size);
+		errors++;
+	}
+	char *ce=strstr(resp, "Content-Encoding: gzip");
+	if ((ce!=NULL && ce<body)!=gzip) {
+		fprintf(stderr, "%s: wrong Content-Encoding\n", job->name);
+		errors++;
+	}
+	int seekable=strstr(resp, "Accept-Ranges: bytes")!=NULL;
+	free(resp);
+
+	//The second half of the file, the range is about what's stored
+	if (seekable && size>1) {
+		int first=size/2, last=size-1;
+		char head[128], range[64];
+		sprintf(head, "Accept-Encoding: gzip\r\nRange: bytes=%d-\r\n", first);
+		sprintf(range, "Content-Range: bytes %d-%d/%d\r\n", first, last, size);
+		len=httpdHostGet(url, head, &resp);
+		body=len>0 ? strstr(resp, "\r\n\r\n") : NULL;
+		if (body==NULL || strncmp(resp, "HTTP/1.0 206", 12)!=0 || strstr(resp, range)==NULL ||
+				len-(body+4-resp)!=last-first+1 || memcmp(body+4, stored+first, last-first+1)!=0) {
+			fprintf(stderr, "%s: wrong response to a byte range\n", job->name);
+			errors++;
+		}
+		free(resp);
+	}
+	return errors;
+}
+
+//Read an existing image back through espfs.c, the code the firmware uses, and check it against
+//the files listed on stdin. Then time opening and reading them. Returns the number of problems.
+int verifyImage(char *imageName) {
+	int errors=0;
+	int f=open(imageName, O_RDONLY);
+	if (f<0) {
+		perror(imageName);
+		return 1;
+	}
+	off_t imgSize=lseek(f, 0, SEEK_END);
+	char *img=mmap(NULL, imgSize, PROT_READ, MAP_SHARED, f, 0);
+	close(f);
+	if (img==MAP_FAILED || espFsInit(espLinkCtx, img, ESPFS_MEMORY)!=ESPFS_INIT_RESULT_OK) {
+		fprintf(stderr, "%s: not an espfs image\n", imageName);
+		return 1;
+	}
+
+	errors+=checkMemcpyAligned();
+
+	//Every file comes back as it went in, and is served as such
+	off_t total=0;
+	for (int i=0; i<numJobs; i++) {
+		FileJob *job=&jobs[i];
+		handleFile(job); //just to get the original data mapped
+		if (!job->ok) {
+			errors++;
+			continue;
+		}
+		EspFsFile *fh=espFsOpen(espLinkCtx, job->name);
+		if (fh==NULL) {
+			fprintf(stderr, "%s: missing\n", job->name);
+			errors++;
+			continue;
+		}
+		//The size is that of the data read back, which for gzipped files is the stored data
+		int flags=espFsFlags(fh), size=espFsSize(fh), len=0, n;
+		char *buf=malloc(size+1);
+		while (len<=size && (n=espFsRead(fh, buf+len, size+1-len<1460 ? size+1-len : 1460))>0) len+=n;
+		espFsClose(fh);
+		if (len!=size) {
+			fprintf(stderr, "%s: size is %d, %d bytes read\n", job->name, size, len);
+			errors++;
+		} else {
+			errors+=checkServed(job, buf, size, (flags & FLAG_GZIP)!=0);
+		}
+		char *data=buf;
+		if (flags & FLAG_GZIP) {
+#ifdef ESPFS_GZIP
+			data=malloc(job->size+1);
+			len=decompressGzip(buf, len, data, job->size+1);
+#else
+			fprintf(stderr, "%s: gzipped, can't check without zlib\n", job->name);
+#endif
+		} else if (size!=job->size) {
+			fprintf(stderr, "%s: size is %d, should be %d\n", job->name, size, (int)job->size);
+			errors++;
+		}
+		if ((flags & FLAG_MIME_MASK)>>FLAG_MIME_SHIFT != mimeIndex(job->name)) {
+			fprintf(stderr, "%s: wrong mime type\n", job->name);
+			errors++;
+		}
+		if (len!=job->size || memcmp(data, job->fdat, len)!=0) {
+			fprintf(stderr, "%s: contents differ\n", job->name);
+			errors++;
+		}
+		if (data!=buf) free(data);
+		free(buf);
+		total+=job->size;
+	}
+
+	//The iterator sees the same files
+	EspFsIterator it;
+	int count=0;
+	espFsIteratorInit(espLinkCtx, &it);
+	while (espFsIteratorNext(&it)) count++;
+	if (count!=numJobs) {
+		fprintf(stderr, "iterator found %d files, should be %d\n", count, numJobs);
+		errors++;
+	}
+
+	//Benchmark: open every file, and open and read every file, for at least half a second
+	if (numJobs>0 && errors==0) {
+		char buf[1460];
+		int rounds=0;
+		double t=now(), dt;
+		do {
+			for (int i=0; i<numJobs; i++) espFsClose(espFsOpen(espLinkCtx, jobs[i].name));
+			rounds++;
+		} while ((dt=now()-t)<0.5);
+		fprintf(stderr, "open: %.2f us per file\n", dt*1e6/rounds/numJobs);
+		rounds=0;
+		t=now();
+		do {
+			for (int i=0; i<numJobs; i++) {
+				EspFsFile *fh=espFsOpen(espLinkCtx, jobs[i].name);
+				while (espFsRead(fh, buf, sizeof(buf))>0) ;
+				espFsClose(fh);
+			}
+			rounds++;
+		} while ((dt=now()-t)<0.5);
+		fprintf(stderr, "open+read: %.2f us per file, %.1f MB/s\n", dt*1e6/rounds/numJobs,
+			total*rounds/dt/1e6);
+	}
+	fprintf(stderr, "%d files checked, %d problems\n", numJobs, errors);
+	return errors;
 }
 
 int main(int argc, char **argv) {
-	int f, x;
+	int x;
 	char fileName[1024];
 	char *realName;
 	struct stat statBuf;
 	int serr;
-	int rate;
 	int err=0;
-	int compType;  //default compression type - heatshrink
-	int compLvl=-1;
-
-	compType = COMPRESS_NONE;
+	int threads=1;
+	char *verify=NULL;
+#ifndef __WIN32__
+	threads=sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 
 	for (x=1; x<argc; x++) {
 		if (strcmp(argv[x], "-c")==0 && argc>=x-2) {
@@ -242,6 +702,13 @@ int main(int argc, char **argv) {
 			compLvl=atoi(argv[x+1]);
 			if (compLvl<1 || compLvl>9) err=1;
 			x++;
+		} else if (strcmp(argv[x], "-v")==0 && argc>=x-2) {
+			verify=argv[x+1];
+			x++;
+		} else if (strcmp(argv[x], "-j")==0 && argc>=x-2) {
+			threads=atoi(argv[x+1]);
+			if (threads<1) err=1;
+			x++;
 #ifdef ESPFS_GZIP
 		} else if (strcmp(argv[x], "-g")==0 && argc>=x-2) {
 			if (!parseGzipExtensions(argv[x+1])) err=1;
@@ -260,14 +727,18 @@ int main(int argc, char **argv) {
 
 	if (err) {
 		fprintf(stderr, "%s - Program to create espfs images\n", argv[0]);
-		fprintf(stderr, "Usage: \nfind | %s [-c compressor] [-l compression_level] ", argv[0]);
+		fprintf(stderr, "Usage: \nfind | %s [-c compressor] [-l compression_level] [-j threads] ", argv[0]);
 #ifdef ESPFS_GZIP
 		fprintf(stderr, "[-g gzipped_extensions] ");
 #endif
 		fprintf(stderr, "> out.espfs\n");
+		fprintf(stderr, "   or: find | %s [-g gzipped_extensions] -v image.espfs\n", argv[0]);
 		fprintf(stderr, "Compressors:\n");
 		fprintf(stderr, "0 - None(default)\n");
+		fprintf(stderr, "1 - Heatshrink (for files that aren't gzipped)\n");
 		fprintf(stderr, "\nCompression level: 1 is worst but low RAM usage, higher is better compression \nbut uses more ram on decompression. -1 = compressors default.\n");
+		fprintf(stderr, "\nThreads: number of files compressed in parallel, defaults to the number of CPUs.\n");
+		fprintf(stderr, "\nWith -v the listed files are checked against an existing image, which is read back\nwith the firmware's espfs and httpdespfs code, and opening and reading them is timed.\n");
 #ifdef ESPFS_GZIP
 		fprintf(stderr, "\nGzipped extensions: list of comma separated, case sensitive file extensions \nthat will be gzipped. Defaults to 'html,css,js'\n");
 #endif
@@ -288,23 +759,48 @@ int main(int argc, char **argv) {
 			realName=fileName;
 			if (fileName[0]=='.') realName++;
 			if (realName[0]=='/') realName++;
-			f=open(fileName, O_RDONLY);
-			if (f>0) {
-				char *compName = "unknown";
-        off_t csize;
-				rate=handleFile(f, realName, compType, compLvl, &compName, &csize);
-				fprintf(stderr, "%-16s (%3d%%, %s, %4u bytes)\n", realName, rate, compName, (uint32_t)csize);
-				close(f);
-			} else {
-				perror(fileName);
-			}
+			jobs=realloc(jobs, (numJobs+1)*sizeof(FileJob));
+			memset(&jobs[numJobs], 0, sizeof(FileJob));
+			jobs[numJobs].path=strdup(fileName);
+			jobs[numJobs].dupOf=-1;
+			jobs[numJobs].name=jobs[numJobs].path+(realName-fileName);
+			numJobs++;
 		} else {
 			if (serr!=0) {
 				perror(fileName);
 			}
 		}
 	}
+
+	//The order find lists files in differs between machines, names don't. A file listed twice
+	//only goes in once.
+	qsort(jobs, numJobs, sizeof(FileJob), compareJobs);
+	int unique=0;
+	for (x=0; x<numJobs; x++) {
+		if (unique==0 || strcmp(jobs[x].name, jobs[unique-1].name)!=0) jobs[unique++]=jobs[x];
+		else free(jobs[x].path);
+	}
+	numJobs=unique;
+	if (verify!=NULL) return verifyImage(verify) ? 1 : 0;
+	compressAll(threads);
+
+	off_t totalSize=0, totalComp=0;
+	for (x=0; x<numJobs; x++) {
+		FileJob *job=&jobs[x];
+		if (!job->ok) continue;
+		emitFile(x);
+		totalSize+=job->size;
+		if (job->dupOf>=0) {
+			fprintf(stderr, "%-16s (same as %s)\n", job->name, jobs[job->dupOf].name);
+			continue;
+		}
+		totalComp+=job->csize;
+		fprintf(stderr, "%-16s (%3d%%, %s, %4u bytes)\n", job->name,
+			job->size ? (int)(job->csize*100/job->size) : 100, compressionName(job), (uint32_t)job->csize);
+	}
 	finishArchive();
+	int len=writeImage();
+	fprintf(stderr, "%d files, %u bytes stored in %u (%d%%), image %d bytes\n", numFiles,
+		(uint32_t)totalSize, (uint32_t)totalComp, totalSize ? (int)(totalComp*100/totalSize) : 100, len);
 	return 0;
 }
-
@@ -7,6 +7,11 @@ function fetchText(delay, repeat) {
     el.innerHTML = "";
   }
   window.setTimeout(function() {
+    // while the websocket is up it delivers the text, just keep the timer going
+    if (consoleWs != null && consoleWs.readyState == 1) {
+      if (repeat) fetchText(1000, repeat);
+      return;
+    }
     ajaxJson('GET', console_url + "?start=" + el.textEnd,
       function(resp) {
         var dly = updateText(resp);
@@ -49,6 +54,30 @@ function retryLoad(repeat) {
   fetchText(1000, repeat);
 }
 
+//===== Websocket console
+
+var consoleWs = null;
+
+// Stream uart data over a websocket, the ajax polling above takes over whenever it's down
+function consoleWsInit() {
+  if (!window.WebSocket) return;
+  var ws = new WebSocket("ws://" + location.host + "/ws/console");
+  ws.binaryType = "arraybuffer";
+  ws.onopen = function() { consoleWs = ws; };
+  ws.onmessage = function(ev) {
+    var bytes = new Uint8Array(ev.data);
+    var text = "";
+    for (var i = 0; i < bytes.length; i++)
+      if (bytes[i] != 13) text += String.fromCharCode(bytes[i]);
+    var el = $("#console");
+    updateText({ start: el.textEnd, len: bytes.length, text: text });
+  };
+  ws.onclose = function() {
+    consoleWs = null;
+    window.setTimeout(consoleWsInit, 5000);
+  };
+}
+
 //===== Text entry
 
 function consoleSendInit() {
@@ -130,6 +159,10 @@ function consoleSendInit() {
         if (inputAddLf.checked) text += '\n';
         pushHistory(inputText.value);
         inputText.value = "";
+        if (consoleWs != null && consoleWs.readyState == 1) {
+          consoleWs.send(text);
+          break;
+        }
         ajaxSpin('POST', "/console/send?text=" + encodeURIComponent(text),
           function(resp) { showNotification("Text sent"); },
           function(s, st) { showWarning("Error sending text"); }
@@ -16,6 +16,7 @@ Esp8266 http server - core routines
 
 #include <esp8266.h>
 #include "httpd.h"
+#include "espfsmime.h"
 
 //#define HTTPD_DBG
 #ifdef HTTPD_DBG
@@ -29,10 +30,21 @@ Esp8266 http server - core routines
 #define MAX_HEAD_LEN 1024
 //Max amount of connections
 #define MAX_CONN 6
+//Seconds a connection may sit without traffic, e.g. kept alive waiting for another request
+#define HTTPD_IDLE_SECS 10
+//Free heap to leave to the rest of the system, connections are refused below this
+#define HTTPD_MIN_HEAP (8*1024)
 //Max post buffer len
 #define MAX_POST 1024
+//Max amount of pipelined request data held while the response to an earlier request goes out
+#define MAX_PENDING 2048
+//TCP maximum segment size, lwip accepts up to two segments per espconn_sent
+#define HTTPD_MSS 1460
 //Max send buffer len
-#define MAX_SENDBUFF_LEN 2600
+#define MAX_SENDBUFF_LEN (2*HTTPD_MSS)
+//Chunked encoding overhead: "xxxx\r\n" in front of a chunk, "\r\n" after it and "0\r\n\r\n" at the end
+#define CHUNK_HDR_LEN 6
+#define CHUNK_TRL_LEN 7
 
 
 //This gets set at init time.
@@ -40,56 +52,80 @@ static HttpdBuiltInUrl *builtInUrls;
 
 //Private data for http connection
 struct HttpdPriv {
-  char head[MAX_HEAD_LEN];  // buffer to accumulate header
+  char *head;               // buffer to accumulate header, shrunk to size once it's complete
   char from[24];            // source ip&port
   char *sendBuff;           // output buffer
   short headPos;            // offset into header
+  short headSize;           // size of the head buffer
   short sendBuffLen;        // offset into output buffer
   short sendBuffMax;        // size of output buffer
   short code;               // http response code (only for logging)
+  short flags;              // HFL_*
+  short pendingLen;         // bytes in pending
+  char *pending;            // pipelined requests received while still responding to this one
+  char *chunkHdr;           // where the header of the chunk being filled goes in sendBuff
+  const char *route;        // url table entry handling the request (only for stats)
+  uint32 firstSent;         // system time of the first response bytes, 0 until then
+  uint32 bytesSent;         // response bytes handed to espconn_sent
+  uint32 idleSince;         // system time the connection started waiting for a request
 };
 
-//Connection pool
-static HttpdPriv connPrivData[MAX_CONN];
-static HttpdConnData connData[MAX_CONN];
-static HttpdPostData connPostData[MAX_CONN];
+//Flags in HttpdPriv
+#define HFL_HTTP11      (1<<0) // the client speaks HTTP/1.1
+#define HFL_CHUNKED     (1<<1) // the response body goes out with chunked transfer encoding
+#define HFL_SENDINGBODY (1<<2) // the headers are done, httpdSend is producing the body
+#define HFL_KEEPALIVE   (1<<3) // the connection stays open for further requests
+#define HFL_LENGTH      (1<<4) // the response has a Content-Length header
+#define HFL_NOBODY      (1<<5) // the response status doesn't allow a body
+#define HFL_BUSY        (1<<6) // the request headers are in, the request is being served
+#define HFL_FRAMED      (1<<7) // the end of the chunked response body has been sent
+#define HFL_SERVED      (1<<8) // an earlier request on the connection has been answered
+
+//The state of a connection, allocated in one block when the connection comes in. The send
+//buffer lives here rather than on the stack of each callback, the SDK stack is only 4KB.
+typedef struct {
+  HttpdConnData conn;       // first, so a HttpdConnData * is the slot's address
+  HttpdPriv priv;
+  HttpdPostData post;
+  char sendBuff[MAX_SENDBUFF_LEN];
+} HttpdConnSlot;
+
+//Connection pool, slots are only allocated while a connection is open
+static HttpdConnData *connData[MAX_CONN];
+
+//Request statistics per route, the last slot collects the routes that don't fit
+static HttpdRouteStats routeStats[HTTPD_STATS_ROUTES];
 
 //Listening connection data
 static struct espconn httpdConn;
 static esp_tcp httpdTcp;
 
-//Struct to keep extension->mime data in
-typedef struct {
-  const char *ext;
-  const char *mimetype;
-} MimeMap;
-
-//The mappings from file extensions to mime types. If you need an extra mime type,
-//add it here.
-static const MimeMap mimeTypes[] = {
-  { "htm", "text/htm" },
-  { "html", "text/html; charset=UTF-8" },
-  { "css", "text/css" },
-  { "js", "text/javascript" },
-  { "txt", "text/plain" },
-  { "jpg", "image/jpeg" },
-  { "jpeg", "image/jpeg" },
-  { "png", "image/png" },
-  { "tpl", "text/html; charset=UTF-8" },
-  { NULL, "text/html" }, //default value
-};
-
-//Returns a static char* to a mime type for a given url to a file.
-const char ICACHE_FLASH_ATTR *httpdGetMimetype(char *url) {
-  int i = 0;
+//Returns the index into espFsMimeTypes for the extension of a file name or url, 0 if it isn't
+//in there. The match is case-insensitive.
+int ICACHE_FLASH_ATTR httpdMimeIndex(const char *url) {
+  if (*url == 0) return 0;
   //Go find the extension
-  char *ext = url + (strlen(url) - 1);
+  const char *ext = url + (strlen(url) - 1);
   while (ext != url && *ext != '.') ext--;
   if (*ext == '.') ext++;
 
-  //ToDo: os_strcmp is case sensitive; we may want to do case-intensive matching here...
-  while (mimeTypes[i].ext != NULL && os_strcmp(ext, mimeTypes[i].ext) != 0) i++;
-  return mimeTypes[i].mimetype;
+  for (int i = 1; i < ESPFS_MIME_COUNT; i++) {
+    const char *a = ext, *b = espFsMimeTypes[i].ext;
+    while (*b != 0 && tolower((int)*a) == *b) { a++; b++; }
+    if (*a == 0 && *b == 0) return i;
+  }
+  return 0;
+}
+
+//Returns a static char* to the mime type with the given index into espFsMimeTypes.
+const char ICACHE_FLASH_ATTR *httpdMimetypeByIndex(int idx) {
+  if (idx <= 0 || idx >= ESPFS_MIME_COUNT) return ESPFS_MIME_DEFAULT;
+  return espFsMimeTypes[idx].mimetype;
+}
+
+//Returns a static char* to a mime type for a given url to a file.
+const char ICACHE_FLASH_ATTR *httpdGetMimetype(char *url) {
+  return httpdMimetypeByIndex(httpdMimeIndex(url));
 }
 
 // debug string to identify connection (ip address & port)
@@ -109,12 +145,37 @@ static void debugConn(void *arg, char *what) {
 #endif
 }
 
-// Retires a connection for re-use
-static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
-  if (conn->conn && conn->conn->reverse == conn)
-    conn->conn->reverse = NULL; // break reverse link
+// Account a finished request in the stats of its route, dt is its duration in ms
+static void ICACHE_FLASH_ATTR httpdRecordStats(HttpdConnData *conn, uint32 dt) {
+  HttpdPriv *p = conn->priv;
+  if (p->route == NULL) return; // the request never got routed
 
-  // log information about the request we handled
+  int i;
+  for (i = 0; i<HTTPD_STATS_ROUTES-1; i++)
+    if (routeStats[i].count == 0 || routeStats[i].url == p->route) break;
+  HttpdRouteStats *st = &routeStats[i];
+  st->url = i < HTTPD_STATS_ROUTES-1 ? p->route : "(other)";
+
+  st->count++;
+  st->bytes += p->bytesSent;
+  if (p->code >= 400 && p->code < 500 && st->err4xx != 0xffff) st->err4xx++;
+  if (p->code >= 500 && st->err5xx != 0xffff) st->err5xx++;
+  if (p->firstSent != 0) st->ttfbSum += (p->firstSent - conn->startTime) / 1000;
+  if (dt > st->maxMs) st->maxMs = dt;
+  int b = 0;
+  while (b < HTTPD_STATS_BUCKETS-1 && (1UL<<b) <= dt) b++;
+  if (st->hist[b] != 0xffff) st->hist[b]++;
+}
+
+// Return the per-route request statistics, *num gets the number of slots in use
+const HttpdRouteStats * ICACHE_FLASH_ATTR httpdGetStats(int *num) {
+  *num = 0;
+  while (*num < HTTPD_STATS_ROUTES && routeStats[*num].count != 0) (*num)++;
+  return routeStats;
+}
+
+// Log information about the request we handled
+static void ICACHE_FLASH_ATTR httpdLogRequest(HttpdConnData *conn) {
   uint32 dt = conn->startTime;
   if (dt > 0) dt = (system_get_time() - dt) / 1000;
   if (conn->conn && conn->url)
@@ -127,13 +188,55 @@ static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
       conn->requestType == HTTPD_METHOD_GET ? "GET" : "POST", conn->url,
       conn->priv->code, dt, (unsigned long)system_get_free_heap_size());
 #endif
+  if (conn->url) httpdRecordStats(conn, dt);
+}
+
+// Retires a connection for re-use
+static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
+  if (conn->conn && conn->conn->reverse == conn)
+    conn->conn->reverse = NULL; // break reverse link
+  httpdLogRequest(conn);
 
   conn->conn = NULL; // don't try to send anything, the SDK crashes...
   if (conn->cgi != NULL) conn->cgi(conn); // free cgi data
   if (conn->post->buff != NULL) os_free(conn->post->buff);
-  conn->cgi = NULL;
-  conn->post->buff = NULL;
-  conn->post->multipartBoundary = NULL;
+  if (conn->priv->head != NULL) os_free(conn->priv->head);
+  if (conn->priv->pending != NULL) os_free(conn->priv->pending);
+
+  // give the slot back to the heap
+  for (int i = 0; i<MAX_CONN; i++) if (connData[i] == conn) connData[i] = NULL;
+  os_free(conn);
+}
+
+// Once the headers are parsed only the part of the head buffer actually used needs to be kept,
+// the url and header values point into it so those need to be moved along.
+static void ICACHE_FLASH_ATTR httpdShrinkHead(HttpdConnData *conn) {
+  char *old = conn->priv->head;
+  char *head = (char*)os_malloc(conn->priv->headPos + 1);
+  if (head == NULL) return; // keep using the big one
+  os_memcpy(head, old, conn->priv->headPos + 1);
+  if (conn->url != NULL) conn->url = head + (conn->url - old);
+  if (conn->getArgs != NULL) conn->getArgs = head + (conn->getArgs - old);
+  if (conn->post->multipartBoundary != NULL)
+    conn->post->multipartBoundary = head + (conn->post->multipartBoundary - old);
+  os_free(old);
+  conn->priv->head = head;
+  conn->priv->headSize = conn->priv->headPos + 1;
+}
+
+// Report the number of open connections and the heap they hold in *bytes
+int ICACHE_FLASH_ATTR httpdConnStats(int *bytes) {
+  int num = 0;
+  *bytes = 0;
+  for (int i = 0; i<MAX_CONN; i++) {
+    HttpdConnData *conn = connData[i];
+    if (conn == NULL) continue;
+    num++;
+    *bytes += sizeof(HttpdConnSlot) + conn->priv->headSize;
+    if (conn->post->buff != NULL) *bytes += conn->post->buffSize + 1;
+    *bytes += conn->priv->pendingLen;
+  }
+  return num;
 }
 
 //Stupid li'l helper function that returns the value of a hex char.
@@ -234,6 +337,24 @@ void ICACHE_FLASH_ATTR httpdSetOutputBuffer(HttpdConnData *conn, char *buff, sho
   conn->priv->sendBuff = buff;
   conn->priv->sendBuffLen = 0;
   conn->priv->sendBuffMax = max;
+  conn->priv->chunkHdr = NULL;
+}
+
+//Start the output of a callback in the connection's own send buffer
+static void ICACHE_FLASH_ATTR httpdResetOutput(HttpdConnData *conn) {
+  HttpdConnSlot *slot = (HttpdConnSlot *)conn;
+  httpdSetOutputBuffer(conn, slot->sendBuff, sizeof(slot->sendBuff));
+}
+
+//Select how the response body is delimited, call before httpdStartResponse. With
+//HTTPD_TRANSFER_CHUNKED the cgi can keep calling httpdSend across HTTPD_CGI_MORE callbacks
+//and each flush goes out as one chunk. HTTP/1.0 clients get the body delimited by the
+//connection close instead, as does everyone with HTTPD_TRANSFER_CLOSE.
+void ICACHE_FLASH_ATTR httpdSetTransferMode(HttpdConnData *conn, int mode) {
+  if (mode == HTTPD_TRANSFER_CHUNKED && (conn->priv->flags & HFL_HTTP11))
+    conn->priv->flags |= HFL_CHUNKED;
+  else
+    conn->priv->flags &= ~(HFL_CHUNKED|HFL_KEEPALIVE);
 }
 
 //Start the response headers.
@@ -242,7 +363,10 @@ void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code) {
   int l;
   conn->priv->code = code;
   char *status = code < 400 ? "OK" : "ERROR";
-  l = os_sprintf(buff, "HTTP/1.0 %d %s\r\nServer: esp-link\r\nConnection: close\r\n", code, status);
+  if (code == 204 || code == 304) conn->priv->flags |= HFL_NOBODY;
+  l = os_sprintf(buff, "HTTP/1.%d %d %s\r\nServer: esp-link\r\n%s",
+      (conn->priv->flags & HFL_HTTP11) ? 1 : 0, code, status,
+      (conn->priv->flags & HFL_KEEPALIVE) ? "" : "Connection: close\r\n");
   httpdSend(conn, buff, l);
 }
 
@@ -251,13 +375,20 @@ void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const
   char buff[256];
   int l;
 
+  if (os_strcmp(field, "Content-Length") == 0) conn->priv->flags |= HFL_LENGTH;
   l = os_sprintf(buff, "%s: %s\r\n", field, val);
   httpdSend(conn, buff, l);
 }
 
-//Finish the headers.
+//Finish the headers. On a kept-alive connection the end of the body has to be marked, that's
+//done with chunked encoding unless the cgi gave the length.
 void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn) {
+  HttpdPriv *p = conn->priv;
+  if ((p->flags & HFL_KEEPALIVE) && !(p->flags & (HFL_LENGTH|HFL_NOBODY))) p->flags |= HFL_CHUNKED;
+  if (p->flags & (HFL_LENGTH|HFL_NOBODY)) p->flags &= ~HFL_CHUNKED;
+  if (p->flags & HFL_CHUNKED) httpdSend(conn, "Transfer-Encoding: chunked\r\n", -1);
   httpdSend(conn, "\r\n", -1);
+  p->flags |= HFL_SENDINGBODY;
 }
 
 //ToDo: sprintf->snprintf everywhere... esp doesn't have snprintf tho' :/
@@ -282,33 +413,110 @@ int ICACHE_FLASH_ATTR cgiRedirect(HttpdConnData *connData) {
 }
 
 
+//Room left in the send buffer, keeping space for the chunk framing if the body is chunked
+static int ICACHE_FLASH_ATTR httpdSendRoom(HttpdConnData *conn) {
+  HttpdPriv *p = conn->priv;
+  int room = p->sendBuffMax - p->sendBuffLen;
+  if ((p->flags & HFL_CHUNKED) && (p->flags & HFL_SENDINGBODY)) {
+    room -= CHUNK_TRL_LEN;
+    if (p->chunkHdr == NULL) room -= CHUNK_HDR_LEN;
+  }
+  return room < 0 ? 0 : room;
+}
+
+//Leave space for the chunk header in front of body data going into the send buffer
+static void ICACHE_FLASH_ATTR httpdChunkOpen(HttpdConnData *conn) {
+  HttpdPriv *p = conn->priv;
+  if ((p->flags & HFL_CHUNKED) && (p->flags & HFL_SENDINGBODY) && p->chunkHdr == NULL) {
+    p->chunkHdr = p->sendBuff + p->sendBuffLen;
+    p->sendBuffLen += CHUNK_HDR_LEN;
+  }
+}
+
+//Fill in the header of the chunk in the send buffer and terminate it
+static void ICACHE_FLASH_ATTR httpdChunkClose(HttpdConnData *conn) {
+  HttpdPriv *p = conn->priv;
+  if (p->chunkHdr == NULL) return;
+  int len = p->sendBuff + p->sendBuffLen - (p->chunkHdr + CHUNK_HDR_LEN);
+  if (len == 0) {
+    p->sendBuffLen -= CHUNK_HDR_LEN; // an empty chunk would end the body
+  } else {
+    char hex[8];
+    os_sprintf(hex, "%04x\r\n", len);
+    os_memcpy(p->chunkHdr, hex, CHUNK_HDR_LEN);
+    os_memcpy(p->sendBuff + p->sendBuffLen, "\r\n", 2);
+    p->sendBuffLen += 2;
+  }
+  p->chunkHdr = NULL;
+}
+
+//The cgi is done: end a chunked body with the zero-length chunk
+static void ICACHE_FLASH_ATTR httpdChunkEnd(HttpdConnData *conn) {
+  HttpdPriv *p = conn->priv;
+  if (!(p->flags & HFL_CHUNKED) || !(p->flags & HFL_SENDINGBODY)) return;
+  httpdChunkClose(conn);
+  os_memcpy(p->sendBuff + p->sendBuffLen, "0\r\n\r\n", 5);
+  p->sendBuffLen += 5;
+  p->flags &= ~HFL_CHUNKED;
+  p->flags |= HFL_FRAMED;
+}
+
+//Whether the connection can take another request once this response is out: the client must
+//be able to tell where the response ends, raw responses (redirects, websockets) can't be used.
+static int ICACHE_FLASH_ATTR httpdCanKeepAlive(HttpdConnData *conn) {
+  HttpdPriv *p = conn->priv;
+  if (!(p->flags & HFL_KEEPALIVE) || conn->recvHdl != NULL) return 0;
+  if (p->flags & HFL_FRAMED) return 1;
+  return (p->flags & HFL_SENDINGBODY) && (p->flags & (HFL_LENGTH|HFL_NOBODY));
+}
+
 //Add data to the send buffer. len is the length of the data. If len is -1
 //the data is seen as a C-string.
 //Returns 1 for success, 0 for out-of-memory.
 int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len) {
   if (len<0) len = strlen(data);
-  if (conn->priv->sendBuffLen + len>conn->priv->sendBuffMax) {
+  if (len > httpdSendRoom(conn)) {
     DBG("%sERROR! httpdSend full (%d of %d)\n",
       connStr, conn->priv->sendBuffLen, conn->priv->sendBuffMax);
     return 0;
   }
+  httpdChunkOpen(conn);
   os_memcpy(conn->priv->sendBuff + conn->priv->sendBuffLen, data, len);
   conn->priv->sendBuffLen += len;
   return 1;
 }
 
+//Get the free space at the end of the send buffer so a cgi can produce data in place instead
+//of going through a buffer of its own. The number of free bytes is stored in *len, call
+//httpdSendCommit with the number of bytes actually written.
+char * ICACHE_FLASH_ATTR httpdSendBuffer(HttpdConnData *conn, int *len) {
+  *len = httpdSendRoom(conn);
+  httpdChunkOpen(conn);
+  return conn->priv->sendBuff + conn->priv->sendBuffLen;
+}
+
+void ICACHE_FLASH_ATTR httpdSendCommit(HttpdConnData *conn, int len) {
+  conn->priv->sendBuffLen += len;
+}
+
 //Helper function to send any data in conn->priv->sendBuff
 void ICACHE_FLASH_ATTR httpdFlush(HttpdConnData *conn) {
+  httpdChunkClose(conn);
   if (conn->priv->sendBuffLen != 0) {
     sint8 status = espconn_sent(conn->conn, (uint8_t*)conn->priv->sendBuff, conn->priv->sendBuffLen);
     if (status != 0) {
       DBG("%sERROR! espconn_sent returned %d, trying to send %d to %s\n",
           connStr, status, conn->priv->sendBuffLen, conn->url);
+    } else {
+      if (conn->priv->firstSent == 0) conn->priv->firstSent = system_get_time();
+      conn->priv->bytesSent += conn->priv->sendBuffLen;
     }
     conn->priv->sendBuffLen = 0;
   }
 }
 
+static void httpdResponseDone(HttpdConnData *conn);
+
 //Callback called when the data on a socket has been successfully sent.
 static void ICACHE_FLASH_ATTR httpdSentCb(void *arg) {
   debugConn(arg, "httpdSentCb");
@@ -316,28 +524,34 @@ static void ICACHE_FLASH_ATTR httpdSentCb(void *arg) {
   HttpdConnData *conn = (HttpdConnData *)pCon->reverse;
   if (conn == NULL) return; // aborted connection
 
-  char sendBuff[MAX_SENDBUFF_LEN];
-  httpdSetOutputBuffer(conn, sendBuff, sizeof(sendBuff));
+  httpdResetOutput(conn);
 
-  if (conn->cgi == NULL) { //Marked for destruction?
-    //os_printf("Closing 0x%p/0x%p->0x%p\n", arg, conn->conn, conn);
-    espconn_disconnect(conn->conn); // we will get a disconnect callback
+  if (conn->cgi == NULL) { //Response complete?
+    httpdResponseDone(conn);
     return; //No need to call httpdFlush.
   }
 
   int r = conn->cgi(conn); //Execute cgi fn.
   if (r == HTTPD_CGI_DONE) {
+    httpdChunkEnd(conn);
     conn->cgi = NULL; //mark for destruction.
   }
   if (r == HTTPD_CGI_NOTFOUND || r == HTTPD_CGI_AUTHENTICATED) {
     DBG("%sERROR! Bad CGI code %d\n", connStr, r);
     conn->cgi = NULL; //mark for destruction.
   }
+  if (conn->cgi == NULL && conn->priv->sendBuffLen == 0) {
+    httpdResponseDone(conn); // nothing left to send, no sent callback is coming
+    return;
+  }
   httpdFlush(conn);
 }
 
-static const char *httpNotFoundHeader = "HTTP/1.0 404 Not Found\r\nConnection: close\r\n"
-  "Content-Type: text/plain\r\nContent-Length: 12\r\n\r\nNot Found.\r\n";
+//The request is done with: if a POST body is still coming the connection can't be reused
+static void ICACHE_FLASH_ATTR httpdSkipBody(HttpdConnData *conn) {
+  if (conn->post->received < conn->post->len) conn->priv->flags &= ~HFL_KEEPALIVE;
+  conn->post->len = 0; // skip any remaining receives
+}
 
 //This is called when the headers have been received and the connection is ready to send
 //the result headers and data.
@@ -367,9 +581,11 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
         if (match) {
           //os_printf("Is url index %d\n", i);
           conn->cgiData = NULL;
+          conn->cgiPrivData = NULL;
 	  conn->cgiResponse = NULL;
           conn->cgi = builtInUrls[i].cgiCb;
           conn->cgiArg = builtInUrls[i].cgiArg;
+          conn->priv->route = builtInUrls[i].url;
           break;
         }
         i++;
@@ -378,10 +594,15 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
         //Drat, we're at the end of the URL table. This usually shouldn't happen. Well, just
         //generate a built-in 404 to handle this.
         DBG("%s%s not found. 404!\n", connStr, conn->url);
-        httpdSend(conn, httpNotFoundHeader, -1);
+        conn->priv->route = "(not found)";
+        httpdStartResponse(conn, 404);
+        httpdHeader(conn, "Content-Type", "text/plain");
+        httpdHeader(conn, "Content-Length", "12");
+        httpdEndHeaders(conn);
+        httpdSend(conn, "Not Found.\r\n", -1);
         httpdFlush(conn);
         conn->cgi = NULL; //mark for destruction.
-        if (conn->post) conn->post->len = 0; // skip any remaining receives
+        httpdSkipBody(conn);
         return;
       }
     }
@@ -396,9 +617,10 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
     }
     else if (r == HTTPD_CGI_DONE) {
       //Yep, it's happy to do so and already is done sending data.
+      httpdChunkEnd(conn);
       httpdFlush(conn);
       conn->cgi = NULL; //mark for destruction.
-      if (conn->post) conn->post->len = 0; // skip any remaining receives
+      httpdSkipBody(conn);
       return;
     }
     else {
@@ -439,6 +661,7 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
     e = (char*)os_strstr(conn->url, " ");
     if (e == NULL) return; //wtf?
     *e = 0; //terminate url part
+    if (os_strncmp(e + 1, "HTTP/1.1", 8) == 0) conn->priv->flags |= HFL_HTTP11|HFL_KEEPALIVE;
 
     // Count number of open connections
     //esp_tcp *tcp = conn->conn->proto.tcp;
@@ -474,6 +697,11 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
     //DBG("Mallocced buffer for %d + 1 bytes of post data.\n", conn->post->buffSize);
     conn->post->buff = (char*)os_malloc(conn->post->buffSize + 1);
     conn->post->buffLen = 0;
+    conn->post->chunkSize = MAX_POST;
+    conn->post->direct = 0;
+  }
+  else if (os_strncmp(h, "Connection:", 11) == 0) {
+    if (os_strstr(h, "close") || os_strstr(h, "Close")) conn->priv->flags &= ~HFL_KEEPALIVE;
   }
   else if (os_strncmp(h, "Content-Type: ", 14) == 0) {
     if (os_strstr(h, "multipart/form-data")) {
@@ -490,16 +718,57 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
 }
 
 
-//Callback called when there's data available on a socket.
-static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short len) {
-  debugConn(arg, "httpdRecvCb");
-  struct espconn* pCon = (struct espconn *)arg;
-  HttpdConnData *conn = (HttpdConnData *)pCon->reverse;
-  if (conn == NULL) return; // aborted connection
+//Let a POST cgi change how the rest of the body gets delivered, typically called from its first
+//callback. Chunks end at multiples of chunkSize into the body, e.g. to get one flash sector at a
+//time. With direct set post->buff points straight into the received TCP data instead of a copy;
+//the slices are not zero-terminated and can be shorter than a chunk.
+void ICACHE_FLASH_ATTR httpdSetPostChunks(HttpdConnData *conn, int chunkSize, int direct) {
+  conn->post->chunkSize = chunkSize;
+  conn->post->direct = direct;
+}
 
-  char sendBuff[MAX_SENDBUFF_LEN];
-  httpdSetOutputBuffer(conn, sendBuff, sizeof(sendBuff));
+//Apply a change made with httpdSetPostChunks once the current chunk has been consumed
+static void ICACHE_FLASH_ATTR httpdPostResize(HttpdConnData *conn) {
+  HttpdPostData *post = conn->post;
+  if (post->direct) {
+    if (post->buff != NULL) os_free(post->buff); // not needed anymore
+    post->buff = NULL;
+    return;
+  }
+  if (post->chunkSize == post->buffSize || post->received >= post->len) return;
+  char *buff = (char*)os_malloc(post->chunkSize + 1);
+  if (buff == NULL) {
+    post->chunkSize = post->buffSize; // keep going with what we have
+    return;
+  }
+  os_free(post->buff);
+  post->buff = buff;
+  post->buffSize = post->chunkSize;
+}
 
+//Hold on to data that arrived while the response to the previous request is still going out,
+//it gets parsed once that's done
+static void ICACHE_FLASH_ATTR httpdQueue(HttpdConnData *conn, char *data, int len) {
+  HttpdPriv *p = conn->priv;
+  if (!(p->flags & HFL_KEEPALIVE)) return; // closing after this response anyway
+  char *buf = NULL;
+  if (p->pendingLen + len <= MAX_PENDING) buf = (char*)os_malloc(p->pendingLen + len);
+  if (buf == NULL) {
+    os_printf("%sHTTP: pipeline overflow, closing after response\n", connStr);
+    p->flags &= ~HFL_KEEPALIVE;
+    return;
+  }
+  if (p->pending != NULL) {
+    os_memcpy(buf, p->pending, p->pendingLen);
+    os_free(p->pending);
+  }
+  os_memcpy(buf + p->pendingLen, data, len);
+  p->pending = buf;
+  p->pendingLen += len;
+}
+
+//Run received data through the request parser
+static void ICACHE_FLASH_ATTR httpdParse(HttpdConnData *conn, char *data, int len) {
   //This is slightly evil/dirty: we abuse conn->post->len as a state variable for where in the http communications we are:
   //<0 (-1): Post len unknown because we're still receiving headers
   //==0: No post data
@@ -507,8 +776,26 @@ static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short
   //ToDo: See if we can use something more elegant for this.
 
   for (int x = 0; x<len; x++) {
+    if ((conn->priv->flags & HFL_BUSY) && conn->post->received >= conn->post->len) {
+      //The request is complete, anything else is the next one (pipelining)
+      httpdQueue(conn, data+x, len-x);
+      return;
+    }
     if (conn->post->len<0) {
       //This byte is a header byte.
+      if (conn->priv->head == NULL) {
+        //Kept-alive connections get a head buffer once the next request starts
+        conn->priv->head = (char*)os_malloc(MAX_HEAD_LEN + 1);
+        if (conn->priv->head == NULL) {
+          os_printf("%sHTTP: low heap (%ld), dropping conn\n", connStr,
+              (unsigned long)system_get_free_heap_size());
+          espconn_disconnect(conn->conn);
+          return;
+        }
+        conn->priv->headSize = MAX_HEAD_LEN + 1;
+        conn->priv->headPos = 0;
+        conn->startTime = system_get_time();
+      }
       if (conn->priv->headPos != MAX_HEAD_LEN) conn->priv->head[conn->priv->headPos++] = data[x];
       conn->priv->head[conn->priv->headPos] = 0;
       //Scan for /r/n/r/n. Receiving this indicate the headers end.
@@ -527,27 +814,110 @@ static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short
           httpdParseHeader(p, conn);  //and parse it.
           p = e + 2;            //Skip /r/n (now /0/n)
         }
+        httpdShrinkHead(conn);
+        conn->priv->flags |= HFL_BUSY;
         //If we don't need to receive post data, we can send the response now.
         if (conn->post->len == 0) {
           httpdProcessRequest(conn);
+          //The cgi may have switched protocols, hand it whatever followed the headers
+          if (conn->recvHdl != NULL) {
+            if (x+1 < len) conn->recvHdl(conn, data+x+1, len-x-1);
+            return;
+          }
         }
       }
     }
     else if (conn->post->len != 0) {
-      //This byte is a POST byte.
-      conn->post->buff[conn->post->buffLen++] = data[x];
-      conn->post->received++;
-      if (conn->post->buffLen >= conn->post->buffSize || conn->post->received == conn->post->len) {
+      //This is POST data: take all of it that belongs to the current chunk in one go.
+      HttpdPostData *post = conn->post;
+      int n = len - x;
+      int toBoundary = post->chunkSize - post->received % post->chunkSize;
+      if (n > post->len - post->received) n = post->len - post->received;
+      if (n > toBoundary) n = toBoundary;
+      char direct = post->direct;
+      if (direct) {
+        post->buff = data + x; // hand the cgi a slice of the received data
+        post->buffLen = n;
+      } else {
+        if (n > post->buffSize - post->buffLen) n = post->buffSize - post->buffLen;
+        os_memcpy(post->buff + post->buffLen, data + x, n);
+        post->buffLen += n;
+      }
+      post->received += n;
+      x += n - 1; //the loop skips the last one
+      if (direct || post->buffLen >= post->buffSize || n == toBoundary || post->received == post->len) {
         //Received a chunk of post data
-        conn->post->buff[conn->post->buffLen] = 0; //zero-terminate, in case the cgi handler knows it can use strings
+        if (!direct) post->buff[post->buffLen] = 0; //zero-terminate, in case the cgi handler knows it can use strings
         //Send the response.
         httpdProcessRequest(conn);
-        conn->post->buffLen = 0;
+        post->buffLen = 0;
+        if (direct) post->buff = NULL;
+        httpdPostResize(conn);
       }
     }
   }
 }
 
+//Get the connection ready for the next request on it and start on whatever of it is queued up
+static void ICACHE_FLASH_ATTR httpdNextRequest(HttpdConnData *conn) {
+  HttpdPriv *p = conn->priv;
+  HttpdPostData *post = conn->post;
+  httpdLogRequest(conn);
+
+  if (post->buff != NULL) os_free(post->buff);
+  os_memset(post, 0, sizeof(HttpdPostData));
+  post->len = -1;
+  if (p->head != NULL) os_free(p->head);
+  p->head = NULL;
+  p->headPos = p->headSize = 0;
+  p->flags = HFL_SERVED;
+  p->code = 0;
+  p->route = NULL;
+  p->firstSent = p->bytesSent = 0;
+  conn->url = conn->getArgs = NULL;
+  conn->cgiArg = NULL;
+  conn->cgiData = conn->cgiPrivData = conn->cgiResponse = NULL;
+  conn->cgi = NULL;
+  conn->startTime = 0;
+  p->idleSince = system_get_time();
+
+  char *pending = p->pending;
+  int pendingLen = p->pendingLen;
+  p->pending = NULL;
+  p->pendingLen = 0;
+  if (pending != NULL) {
+    httpdParse(conn, pending, pendingLen);
+    os_free(pending);
+  }
+}
+
+//The response is out: go on with the next request on a kept-alive connection, else close
+static void ICACHE_FLASH_ATTR httpdResponseDone(HttpdConnData *conn) {
+  if (httpdCanKeepAlive(conn)) {
+    httpdNextRequest(conn);
+    return;
+  }
+  //os_printf("Closing 0x%p/0x%p->0x%p\n", arg, conn->conn, conn);
+  espconn_disconnect(conn->conn); // we will get a disconnect callback
+}
+
+//Callback called when there's data available on a socket.
+static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short len) {
+  debugConn(arg, "httpdRecvCb");
+  struct espconn* pCon = (struct espconn *)arg;
+  HttpdConnData *conn = (HttpdConnData *)pCon->reverse;
+  if (conn == NULL) return; // aborted connection
+
+  httpdResetOutput(conn);
+
+  // Connections that switched protocols (websockets) get the raw data
+  if (conn->recvHdl != NULL) {
+    conn->recvHdl(conn, data, len);
+    return;
+  }
+  httpdParse(conn, data, len);
+}
+
 static void ICACHE_FLASH_ATTR httpdDisconCb(void *arg) {
   debugConn(arg, "httpdDisconCb");
   struct espconn* pCon = (struct espconn *)arg;
@@ -568,13 +938,33 @@ static void ICACHE_FLASH_ATTR httpdReconCb(void *arg, sint8 err) {
 }
 
 
+//Close the kept-alive connection that's been waiting for another request the longest, to keep a
+//slot free for a new client rather than have idle connections lock everybody else out. Fresh
+//connections may have their first request on the way, they're left alone.
+static void ICACHE_FLASH_ATTR httpdDropIdle(HttpdConnData *keep) {
+  HttpdConnData *idle = NULL;
+  uint32 now = system_get_time();
+  for (int i = 0; i<MAX_CONN; i++) {
+    HttpdConnData *conn = connData[i];
+    if (conn == NULL) return; // there's a free slot
+    if (conn == keep || !(conn->priv->flags & HFL_SERVED) || (conn->priv->flags & HFL_BUSY) ||
+        conn->priv->headPos != 0 || conn->recvHdl != NULL) continue;
+    if (idle == NULL || now - conn->priv->idleSince > now - idle->priv->idleSince) idle = conn;
+  }
+  if (idle == NULL) return;
+  struct espconn *pCon = idle->conn;
+  DBG("%sHTTP: all slots taken, dropping idle %s\n", connStr, idle->priv->from);
+  httpdRetireConn(idle);
+  espconn_disconnect(pCon);
+}
+
 static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
   debugConn(arg, "httpdConnectCb");
   struct espconn *conn = arg;
 
   // Find empty conndata in pool
   int i;
-  for (i = 0; i<MAX_CONN; i++) if (connData[i].conn == NULL) break;
+  for (i = 0; i<MAX_CONN; i++) if (connData[i] == NULL) break;
   //DBG("Con req, conn=%p, pool slot %d\n", conn, i);
   if (i == MAX_CONN) {
     os_printf("%sHTTP: conn pool overflow!\n", connStr);
@@ -582,26 +972,43 @@ static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
     return;
   }
 
+  // Only take the connection if that leaves enough heap for everything else
+  HttpdConnSlot *slot = NULL;
+  char *head = NULL;
+  if (system_get_free_heap_size() >= HTTPD_MIN_HEAP + sizeof(HttpdConnSlot) + MAX_HEAD_LEN + 1) {
+    slot = (HttpdConnSlot*)os_zalloc(sizeof(HttpdConnSlot));
+    head = (char*)os_malloc(MAX_HEAD_LEN + 1);
+  }
+  if (slot == NULL || head == NULL) {
+    os_printf("%sHTTP: low heap (%ld), dropping conn\n", connStr,
+        (unsigned long)system_get_free_heap_size());
+    if (slot != NULL) os_free(slot);
+    if (head != NULL) os_free(head);
+    espconn_disconnect(conn);
+    return;
+  }
+  connData[i] = &slot->conn;
+
 #if 0
   int num = 0;
-  for (int j = 0; j<MAX_CONN; j++) if (connData[j].conn != NULL) num++;
+  for (int j = 0; j<MAX_CONN; j++) if (connData[j] != NULL) num++;
   DBG("%sConnect (%d open)\n", connStr, num + 1);
 #endif
 
-  connData[i].priv = &connPrivData[i];
-  connData[i].conn = conn;
-  conn->reverse = connData+i;
-  connData[i].priv->headPos = 0;
+  slot->conn.priv = &slot->priv;
+  slot->conn.conn = conn;
+  conn->reverse = &slot->conn;
+  slot->priv.head = head;
+  slot->priv.headSize = MAX_HEAD_LEN + 1;
+  slot->priv.headPos = 0;
 
   esp_tcp *tcp = conn->proto.tcp;
-  os_sprintf(connData[i].priv->from, "%d.%d.%d.%d:%d", tcp->remote_ip[0], tcp->remote_ip[1],
+  os_sprintf(slot->priv.from, "%d.%d.%d.%d:%d", tcp->remote_ip[0], tcp->remote_ip[1],
       tcp->remote_ip[2], tcp->remote_ip[3], tcp->remote_port);
-  connData[i].post = &connPostData[i];
-  connData[i].post->buff = NULL;
-  connData[i].post->buffLen = 0;
-  connData[i].post->received = 0;
-  connData[i].post->len = -1;
-  connData[i].startTime = system_get_time();
+  slot->conn.post = &slot->post;
+  slot->post.len = -1;
+  slot->conn.startTime = system_get_time();
+  slot->priv.idleSince = slot->conn.startTime;
 
   espconn_regist_recvcb(conn, httpdRecvCb);
   espconn_regist_reconcb(conn, httpdReconCb);
@@ -609,6 +1016,8 @@ static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
   espconn_regist_sentcb(conn, httpdSentCb);
 
   espconn_set_opt(conn, ESPCONN_REUSEADDR | ESPCONN_NODELAY);
+  espconn_regist_time(conn, HTTPD_IDLE_SECS, 1);
+  httpdDropIdle(&slot->conn);
 }
 
 //Httpd initialization routine. Call this to kick off webserver functionality.
@@ -616,7 +1025,7 @@ void ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port) {
   int i;
 
   for (i = 0; i<MAX_CONN; i++) {
-    connData[i].conn = NULL;
+    connData[i] = NULL;
   }
   httpdConn.type = ESPCONN_TCP;
   httpdConn.state = ESPCONN_NONE;
@@ -635,9 +1044,9 @@ HttpdConnData * ICACHE_FLASH_ATTR  httpdLookUpConn(uint8_t * ip, int port) {
 
   for (i = 0; i<MAX_CONN; i++)
   {
-    HttpdConnData *conn = connData+i;
+    HttpdConnData *conn = connData[i];
 
-    if (conn->conn == NULL)
+    if (conn == NULL || conn->conn == NULL)
       continue;
     if (conn->cgi == NULL)
       continue;
@@ -658,9 +1067,7 @@ HttpdConnData * ICACHE_FLASH_ATTR  httpdLookUpConn(uint8_t * ip, int port) {
 // when MCU response arrives, the handler looks up connection based on ip/port and call httpdSetCGIResponse with the data to transmit
 
 int ICACHE_FLASH_ATTR httpdSetCGIResponse(HttpdConnData * conn, void * response) {
-  char sendBuff[MAX_SENDBUFF_LEN];
-  conn->priv->sendBuff = sendBuff;
-  conn->priv->sendBuffLen = 0;
+  httpdResetOutput(conn);
 
   conn->cgiResponse = response;
   httpdProcessRequest(conn);
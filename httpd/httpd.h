@@ -11,12 +11,16 @@
 #define HTTPD_METHOD_GET 1
 #define HTTPD_METHOD_POST 2
 
+#define HTTPD_TRANSFER_CLOSE 0
+#define HTTPD_TRANSFER_CHUNKED 1
+
 
 typedef struct HttpdPriv HttpdPriv;
 typedef struct HttpdConnData HttpdConnData;
 typedef struct HttpdPostData HttpdPostData;
 
 typedef int (* cgiSendCallback)(HttpdConnData *connData);
+typedef void (* cgiRecvHandler)(HttpdConnData *connData, char *data, unsigned short len);
 
 //A struct describing a http connection. This gets passed to cgi functions.
 struct HttpdConnData {
@@ -33,6 +37,7 @@ struct HttpdConnData {
 	void *cgiResponse; // used for forwarding response to the CGI handler
 	HttpdPriv *priv;
 	cgiSendCallback cgi;
+	cgiRecvHandler recvHdl; // if set, raw data received after the request headers goes here
 	HttpdPostData *post;
 };
 
@@ -44,8 +49,24 @@ struct HttpdPostData {
 	int received; // The total amount of bytes received so far
 	char *buff; // Actual POST data buffer
 	char *multipartBoundary;
+	int chunkSize; // Data is handed to the cgi in chunks ending at multiples of this
+	char direct; // buff points into the received data instead of holding a copy (zero-copy)
 };
 
+#define HTTPD_STATS_ROUTES 12
+#define HTTPD_STATS_BUCKETS 12
+
+//Request statistics for one route of the url table, see httpdGetStats
+typedef struct {
+	const char *url; // route in the url table
+	uint32_t count; // requests handled
+	uint32_t bytes; // response bytes sent
+	uint32_t ttfbSum; // time to first byte in ms, summed over all requests
+	uint32_t maxMs; // slowest request in ms
+	uint16_t err4xx, err5xx; // error responses
+	uint16_t hist[HTTPD_STATS_BUCKETS]; // durations: bucket i counts requests under 2^i ms, the last one all others
+} HttpdRouteStats;
+
 //A struct describing an url. This is the main struct that's used to send different URL requests to
 //different routines.
 typedef struct {
@@ -60,13 +81,21 @@ int httpdUrlDecode(char *val, int valLen, char *ret, int retLen);
 int ICACHE_FLASH_ATTR httpdFindArg(char *line, char *arg, char *buff, int buffLen);
 void ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port);
 const char *httpdGetMimetype(char *url);
+int httpdMimeIndex(const char *url);
+const char *httpdMimetypeByIndex(int idx);
 void ICACHE_FLASH_ATTR httpdSetOutputBuffer(HttpdConnData *conn, char *buff, short max);
+void ICACHE_FLASH_ATTR httpdSetTransferMode(HttpdConnData *conn, int mode);
 void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code);
 void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const char *val);
 void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn);
 int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen);
 int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len);
+char * ICACHE_FLASH_ATTR httpdSendBuffer(HttpdConnData *conn, int *len);
+void ICACHE_FLASH_ATTR httpdSendCommit(HttpdConnData *conn, int len);
+void ICACHE_FLASH_ATTR httpdSetPostChunks(HttpdConnData *conn, int chunkSize, int direct);
 void ICACHE_FLASH_ATTR httpdFlush(HttpdConnData *conn);
+int ICACHE_FLASH_ATTR httpdConnStats(int *bytes);
+const HttpdRouteStats * ICACHE_FLASH_ATTR httpdGetStats(int *num);
 HttpdConnData * ICACHE_FLASH_ATTR  httpdLookUpConn(uint8_t * ip, int port);
 int ICACHE_FLASH_ATTR  httpdSetCGIResponse(HttpdConnData * conn, void *response);
 
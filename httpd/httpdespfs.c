@@ -20,16 +20,45 @@ Connector to let httpd use the espfs filesystem to serve the files in it.
 // If the client does not advertise that he accepts GZIP send following warning message (telnet users for e.g.)
 static const char *gzipNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 52\r\n\r\nYour browser does not accept gzip-compressed data.\r\n";
 
+//Parse a "Range: bytes=first-last" header for a file of the given size into *first and *last
+//(inclusive). Returns 1 for a usable range, 0 if the whole file should be sent (no header,
+//multiple ranges, syntax we don't understand) and -1 if the range can't be satisfied.
+static int ICACHE_FLASH_ATTR
+parseRange(HttpdConnData *connData, int size, int *first, int *last) {
+	char buff[64];
+	if (!httpdGetHeader(connData, "Range", buff, sizeof(buff))) return 0;
+	if (os_strncmp(buff, "bytes=", 6) != 0 || os_strchr(buff, ',') != NULL) return 0;
+	char *p = buff+6, *dash = os_strchr(p, '-');
+	if (dash == NULL) return 0;
+	if (size == 0) return -1;
+
+	if (dash == p) {
+		//Suffix range: the last N bytes
+		int n = atoi(dash+1);
+		if (n <= 0) return -1;
+		*first = n > size ? 0 : size-n;
+		*last = size-1;
+	} else {
+		*first = atoi(p);
+		if (*first >= size) return -1;
+		*last = dash[1] != 0 ? atoi(dash+1) : size-1;
+		if (*last >= size) *last = size-1;
+		if (*last < *first) return 0;
+	}
+	return 1;
+}
+
 //This is a catch-all cgi function. It takes the url passed to it, looks up the corresponding
 //path in the filesystem and if it exists, passes the file through. This simulates what a normal
 //webserver would do with static files.
 int ICACHE_FLASH_ATTR 
 cgiEspFsHook(HttpdConnData *connData) {
 	EspFsFile *file=connData->cgiData;
-	int len;
-	char buff[1024];
+	int len, avail;
+	char *buff;
 	char acceptEncodingBuffer[64];
-	int isGzip;
+	int isGzip, seekable, size, first, last, range;
+	char rangeBuffer[48];
 
 	//os_printf("cgiEspFsHook conn=%p conn->conn=%p file=%p\n", connData, connData->conn, file);
 
@@ -77,20 +106,60 @@ cgiEspFsHook(HttpdConnData *connData) {
 			}
 		}
 
+		//Byte ranges refer to the file as stored, they are only possible if we can seek in it.
+		size = espFsSize(file);
+		seekable = espFsSeek(file, 0) == 0;
+		range = seekable ? parseRange(connData, size, &first, &last) : 0;
+		if (range < 0) {
+			os_sprintf(rangeBuffer, "bytes */%d", size);
+			httpdStartResponse(connData, 416);
+			httpdHeader(connData, "Content-Range", rangeBuffer);
+			httpdEndHeaders(connData);
+			espFsClose(file);
+			return HTTPD_CGI_DONE;
+		}
+
 		connData->cgiData=file;
-		httpdStartResponse(connData, 200);
-		httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
+		httpdStartResponse(connData, range ? 206 : 200);
+		//The image normally tells the type, older ones leave it to the extension in the url
+		if (espFsMime(file) != 0)
+			httpdHeader(connData, "Content-Type", httpdMimetypeByIndex(espFsMime(file)));
+		else
+			httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
 		if (isGzip) {
 			httpdHeader(connData, "Content-Encoding", "gzip");
 		}
+		if (seekable) {
+			httpdHeader(connData, "Accept-Ranges", "bytes");
+		}
+		if (range) {
+			os_sprintf(rangeBuffer, "bytes %d-%d/%d", first, last, size);
+			httpdHeader(connData, "Content-Range", rangeBuffer);
+			espFsSeek(file, first);
+			size = last-first+1;
+			//Remember how much is left to send, the whole file goes out otherwise.
+			connData->cgiPrivData = (void *)(intptr_t)size;
+		}
+		os_sprintf(rangeBuffer, "%d", size);
+		httpdHeader(connData, "Content-Length", rangeBuffer);
 		httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
 		httpdEndHeaders(connData);
-		return HTTPD_CGI_MORE;
+		//Fall through and fill the rest of the first segments with file data.
 	}
 
-	len=espFsRead(file, buff, 1024);
-	if (len>0) espconn_sent(connData->conn, (uint8 *)buff, len);
-	if (len!=1024) {
+	//Read straight into the httpd send buffer, which holds two full TCP segments. Sending
+	//straight out of the flash mapping isn't possible: it only supports aligned 32-bit loads
+	//and lwip copies the data byte-wise. Reading it here costs the same single copy.
+	buff=httpdSendBuffer(connData, &avail);
+	if (connData->cgiPrivData != NULL && avail > (intptr_t)connData->cgiPrivData)
+		avail = (intptr_t)connData->cgiPrivData;
+	len=espFsRead(file, buff, avail);
+	if (len>0) httpdSendCommit(connData, len);
+	if (connData->cgiPrivData != NULL) {
+		connData->cgiPrivData = (void *)((intptr_t)connData->cgiPrivData - len);
+		if (connData->cgiPrivData == NULL) len = -1; //End of the range.
+	}
+	if (len!=avail) {
 		//We're done.
 		espFsClose(file);
 		return HTTPD_CGI_DONE;
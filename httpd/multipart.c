@@ -254,6 +254,8 @@ int ICACHE_FLASH_ATTR multipartProcess(MultipartCtx * context, HttpdConnData * c
       context->state = STATE_SEARCH_BOUNDARY;
  
       multipartAllocBoundaryBuffer(context);
+      // the parser copies what it needs, so it can work on the received data in place
+      httpdSetPostChunks(connData, post->chunkSize, 1);
       
       if( context->callBack( FILE_UPLOAD_START, NULL, 0, context->position ) ) // start uploading files
         context->state = STATE_ERROR;
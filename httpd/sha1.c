@@ -0,0 +1,68 @@
+/* sha1.c : minimal SHA-1 (FIPS 180-1), used for the websocket handshake */
+/* PUBLIC DOMAIN */
+#include <esp8266.h>
+#include "sha1.h"
+
+#define ROL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void ICACHE_FLASH_ATTR sha1Block(Sha1Ctx *ctx, const uint8_t *blk) {
+  uint32_t w[16];
+  uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2];
+  uint32_t d = ctx->state[3], e = ctx->state[4];
+  int i;
+
+  for (i=0; i<16; i++)
+    w[i] = (blk[4*i]<<24) | (blk[4*i+1]<<16) | (blk[4*i+2]<<8) | blk[4*i+3];
+
+  for (i=0; i<80; i++) {
+    uint32_t f, k, t;
+    if (i >= 16) {
+      t = w[(i+13)&15] ^ w[(i+8)&15] ^ w[(i+2)&15] ^ w[i&15];
+      w[i&15] = ROL(t, 1);
+    }
+    if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+    else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+    else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+    else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+    t = ROL(a, 5) + f + e + k + w[i&15];
+    e = d; d = c; c = ROL(b, 30); b = a; a = t;
+  }
+
+  ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c;
+  ctx->state[3] += d; ctx->state[4] += e;
+}
+
+void ICACHE_FLASH_ATTR sha1Init(Sha1Ctx *ctx) {
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xEFCDAB89;
+  ctx->state[2] = 0x98BADCFE;
+  ctx->state[3] = 0x10325476;
+  ctx->state[4] = 0xC3D2E1F0;
+  ctx->count = 0;
+}
+
+void ICACHE_FLASH_ATTR sha1Update(Sha1Ctx *ctx, const void *data, int len) {
+  const uint8_t *p = data;
+  while (len-- > 0) {
+    ctx->buf[ctx->count++ & 63] = *p++;
+    if ((ctx->count & 63) == 0) sha1Block(ctx, ctx->buf);
+  }
+}
+
+void ICACHE_FLASH_ATTR sha1Final(Sha1Ctx *ctx, uint8_t digest[SHA1_HASH_LEN]) {
+  uint32_t bits = ctx->count << 3;
+  uint8_t pad = 0x80;
+  int i;
+
+  sha1Update(ctx, &pad, 1);
+  pad = 0;
+  while ((ctx->count & 63) != 56) sha1Update(ctx, &pad, 1);
+  // 64-bit big-endian length, we never hash more than 512MB
+  for (i=0; i<4; i++) sha1Update(ctx, &pad, 1);
+  for (i=3; i>=0; i--) {
+    uint8_t b = bits >> (8*i);
+    sha1Update(ctx, &b, 1);
+  }
+  for (i=0; i<SHA1_HASH_LEN; i++)
+    digest[i] = ctx->state[i>>2] >> (8*(3-(i&3)));
+}
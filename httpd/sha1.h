@@ -0,0 +1,16 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#define SHA1_HASH_LEN 20
+
+typedef struct {
+  uint32_t state[5];
+  uint32_t count;     // number of bytes hashed so far
+  uint8_t  buf[64];   // partial block
+} Sha1Ctx;
+
+void sha1Init(Sha1Ctx *ctx);
+void sha1Update(Sha1Ctx *ctx, const void *data, int len);
+void sha1Final(Sha1Ctx *ctx, uint8_t digest[SHA1_HASH_LEN]);
+
+#endif
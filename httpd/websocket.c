@@ -0,0 +1,380 @@
+/*
+Esp8266 http server - websocket (RFC 6455) support
+
+A websocket starts out as a regular GET request that gets routed to cgiWebsocket through
+the url table. After the handshake the connection stays open and the raw TCP data is
+handed to the frame parser below via the connection's recvHdl.
+*/
+
+#include <esp8266.h>
+#include "httpd.h"
+#include "websocket.h"
+#include "sha1.h"
+#include "base64.h"
+
+//#define WEBSOCK_DBG
+#ifdef WEBSOCK_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// Send buffer size, frames get queued here while a send is in progress
+#define WS_TXBUFFER (2*1460)
+// Idle timeout in seconds, websockets are long-lived so the SDK default is too short
+#define WS_TIMEOUT 300
+
+// Frame opcodes and header bits
+#define OP_CONT  0x0
+#define OP_TEXT  0x1
+#define OP_BIN   0x2
+#define OP_CLOSE 0x8
+#define OP_PING  0x9
+#define OP_PONG  0xA
+#define FL_FIN   0x80
+#define FL_MASK  0x80
+
+// Frame parser states
+enum { ST_HEADER, ST_PAYLOAD };
+
+struct WebsockPriv {
+  Websock  *next;         // list of open websockets
+  char     *txbuffer;     // frames waiting to be sent
+  char     *sentbuffer;   // buffer handed to espconn_sent, freed in the sent callback
+  uint16_t txbufferlen;   // bytes in txbuffer
+  bool     readytosend;   // true if no espconn_sent is outstanding
+  bool     closing;       // close frame queued, disconnect once it's out
+  bool     sendCont;      // next frame sent continues a fragmented message
+  // receive side frame parser
+  uint8_t  state;         // ST_HEADER or ST_PAYLOAD
+  uint8_t  hdr[14];       // frame header being assembled
+  uint8_t  hdrLen;        // bytes in hdr
+  uint8_t  mask[4];       // masking key of current frame
+  uint8_t  inMsg;         // opcode of fragmented data message in progress, 0 if none
+  bool     msgStarted;    // part of the current message was delivered already
+  uint32_t payloadLen;    // payload length of current frame
+  uint32_t payloadPos;    // payload bytes consumed so far
+  uint8_t  ctrlBuf[125];  // payload of current control frame
+};
+
+static Websock *wsList; // all open websockets
+
+//===== Sending
+
+// Hand the tx buffer to espconn_sent if the previous send completed
+static void ICACHE_FLASH_ATTR
+wsSendTxBuffer(Websock *ws) {
+  WebsockPriv *p = ws->priv;
+  if (!p->readytosend || p->txbufferlen == 0 || ws->conn->conn == NULL) return;
+  sint8 result = espconn_sent(ws->conn->conn, (uint8_t*)p->txbuffer, p->txbufferlen);
+  if (result != ESPCONN_OK) {
+    os_printf("Websock: espconn_sent error %d, dropping %d bytes\n", result, p->txbufferlen);
+    p->txbufferlen = 0;
+    return;
+  }
+  p->readytosend = false;
+  p->sentbuffer = p->txbuffer;
+  p->txbuffer = NULL;
+  p->txbufferlen = 0;
+}
+
+// Queue a frame with the given first header byte, returns 1 on success, 0 if it doesn't fit
+static int ICACHE_FLASH_ATTR
+wsSendFrame(Websock *ws, uint8_t op, const char *data, int len) {
+  WebsockPriv *p = ws->priv;
+  uint8_t hdr[4];
+  int hdrLen = 2;
+
+  hdr[0] = op;
+  if (len < 126) {
+    hdr[1] = len;
+  } else {
+    hdr[1] = 126;
+    hdr[2] = len >> 8;
+    hdr[3] = len & 0xff;
+    hdrLen = 4;
+  }
+  if (p->txbufferlen + hdrLen + len > WS_TXBUFFER) {
+    DBG("Websock: txbuffer full, dropping %d bytes\n", len);
+    return 0;
+  }
+
+  if (p->txbuffer == NULL) p->txbuffer = os_malloc(WS_TXBUFFER);
+  if (p->txbuffer == NULL) {
+    os_printf("Websock: cannot alloc tx buffer\n");
+    return 0;
+  }
+  os_memcpy(p->txbuffer + p->txbufferlen, hdr, hdrLen);
+  if (len > 0) os_memcpy(p->txbuffer + p->txbufferlen + hdrLen, data, len);
+  p->txbufferlen += hdrLen + len;
+
+  wsSendTxBuffer(ws);
+  return 1;
+}
+
+int ICACHE_FLASH_ATTR
+cgiWebsocketSend(Websock *ws, const char *data, int len, int flags) {
+  if (ws->status != WEBSOCK_OPEN) return 0;
+  uint8_t op = ws->priv->sendCont ? OP_CONT : (flags & WEBSOCK_FLAG_BIN) ? OP_BIN : OP_TEXT;
+  if (!(flags & WEBSOCK_FLAG_MORE)) op |= FL_FIN;
+  if (!wsSendFrame(ws, op, data, len)) return 0;
+  ws->priv->sendCont = (flags & WEBSOCK_FLAG_MORE) != 0;
+  return 1;
+}
+
+void ICACHE_FLASH_ATTR
+cgiWebsocketClose(Websock *ws, int reason) {
+  if (ws->status != WEBSOCK_OPEN) return;
+  char rs[2] = { reason >> 8, reason & 0xff };
+  DBG("Websock: close %d\n", reason);
+  ws->status = WEBSOCK_CLOSED;
+  ws->priv->closing = true;
+  wsSendFrame(ws, FL_FIN|OP_CLOSE, rs, 2);
+}
+
+int ICACHE_FLASH_ATTR
+cgiWebsockBroadcast(const char *resource, const char *data, int len, int flags) {
+  int n = 0;
+  for (Websock *ws = wsList; ws != NULL; ws = ws->priv->next) {
+    if (ws->status == WEBSOCK_OPEN && os_strcmp(ws->conn->url, resource) == 0) {
+      cgiWebsocketSend(ws, data, len, flags);
+      n++;
+    }
+  }
+  return n;
+}
+
+//===== Receiving
+
+// Total length of the frame header given the first two bytes
+static int ICACHE_FLASH_ATTR
+wsHeaderLen(const uint8_t *hdr, int have) {
+  if (have < 2) return 2;
+  int len = 2;
+  if ((hdr[1] & 0x7f) == 126) len += 2;
+  else if ((hdr[1] & 0x7f) == 127) len += 8;
+  if (hdr[1] & FL_MASK) len += 4;
+  return len;
+}
+
+// A complete frame has been received
+static void ICACHE_FLASH_ATTR
+wsEndFrame(Websock *ws) {
+  WebsockPriv *p = ws->priv;
+  uint8_t op = p->hdr[0] & 0x0f;
+  p->state = ST_HEADER;
+
+  switch (op) {
+  case OP_PING:
+    wsSendFrame(ws, FL_FIN|OP_PONG, (char*)p->ctrlBuf, p->payloadLen);
+    break;
+  case OP_PONG:
+    break;
+  case OP_CLOSE:
+    // echo the status code and disconnect once that's out
+    DBG("Websock: close received\n");
+    ws->status = WEBSOCK_CLOSED;
+    p->closing = true;
+    wsSendFrame(ws, FL_FIN|OP_CLOSE, (char*)p->ctrlBuf, p->payloadLen >= 2 ? 2 : 0);
+    break;
+  default:
+    if (p->hdr[0] & FL_FIN) {
+      p->inMsg = 0;
+      p->msgStarted = false;
+    }
+  }
+}
+
+// Consume payload bytes of the current frame, unmasking them in place
+static void ICACHE_FLASH_ATTR
+wsPayload(Websock *ws, char *data, int len) {
+  WebsockPriv *p = ws->priv;
+  uint8_t op = p->hdr[0] & 0x0f;
+
+  for (int i=0; i<len; i++) data[i] ^= p->mask[(p->payloadPos + i) & 3];
+
+  if (op >= OP_CLOSE) {
+    os_memcpy(p->ctrlBuf + p->payloadPos, data, len);
+  } else {
+    int flags = p->inMsg == OP_BIN ? WEBSOCK_FLAG_BIN : WEBSOCK_FLAG_NONE;
+    if (p->msgStarted) flags |= WEBSOCK_FLAG_CONT;
+    if (!(p->hdr[0] & FL_FIN) || p->payloadPos + len < p->payloadLen) flags |= WEBSOCK_FLAG_MORE;
+    if (ws->recvCb) ws->recvCb(ws, data, len, flags);
+    p->msgStarted = true;
+  }
+
+  p->payloadPos += len;
+  if (p->payloadPos == p->payloadLen) wsEndFrame(ws);
+}
+
+// The frame header is complete, validate it and get ready for the payload
+static void ICACHE_FLASH_ATTR
+wsStartFrame(Websock *ws) {
+  WebsockPriv *p = ws->priv;
+  uint8_t op = p->hdr[0] & 0x0f;
+  uint8_t *h = p->hdr + 2;
+  uint32_t len = p->hdr[1] & 0x7f;
+
+  if (len == 126) {
+    len = (h[0] << 8) | h[1];
+    h += 2;
+  } else if (len == 127) {
+    if (h[0] | h[1] | h[2] | h[3]) {
+      cgiWebsocketClose(ws, WEBSOCK_CLOSE_TOO_BIG);
+      return;
+    }
+    len = (h[4] << 24) | (h[5] << 16) | (h[6] << 8) | h[7];
+    h += 8;
+  }
+
+  // clients must mask, control frames must be short and not fragmented, and fragments
+  // of a data message must not be interleaved with other data messages
+  bool ok = (p->hdr[1] & FL_MASK) != 0;
+  if (op >= OP_CLOSE)
+    ok = ok && op <= OP_PONG && len <= sizeof(p->ctrlBuf) && (p->hdr[0] & FL_FIN);
+  else if (op == OP_CONT)
+    ok = ok && p->inMsg != 0;
+  else
+    ok = ok && (op == OP_TEXT || op == OP_BIN) && p->inMsg == 0;
+  if (!ok) {
+    cgiWebsocketClose(ws, WEBSOCK_CLOSE_PROTOCOL);
+    return;
+  }
+
+  if (op == OP_TEXT || op == OP_BIN) p->inMsg = op;
+  os_memcpy(p->mask, h, 4);
+  p->payloadLen = len;
+  p->payloadPos = 0;
+  p->hdrLen = 0;
+  p->state = ST_PAYLOAD;
+  if (len == 0) wsPayload(ws, (char*)p->ctrlBuf, 0);
+}
+
+// Receive handler for the connection once it switched to the websocket protocol
+static void ICACHE_FLASH_ATTR
+wsRecvHdl(HttpdConnData *connData, char *data, unsigned short len) {
+  Websock *ws = connData->cgiData;
+  if (ws == NULL) return;
+  WebsockPriv *p = ws->priv;
+
+  int i = 0;
+  while (i < len && ws->status == WEBSOCK_OPEN) {
+    if (p->state == ST_HEADER) {
+      p->hdr[p->hdrLen++] = data[i++];
+      if (p->hdrLen == wsHeaderLen(p->hdr, p->hdrLen)) wsStartFrame(ws);
+    } else {
+      int n = len - i;
+      if (n > p->payloadLen - p->payloadPos) n = p->payloadLen - p->payloadPos;
+      wsPayload(ws, data+i, n);
+      i += n;
+    }
+  }
+}
+
+//===== Connection handling
+
+static void ICACHE_FLASH_ATTR
+wsFree(Websock *ws) {
+  // unlink from list of open websockets
+  Websock **pp = &wsList;
+  while (*pp != NULL && *pp != ws) pp = &(*pp)->priv->next;
+  if (*pp != NULL) *pp = ws->priv->next;
+
+  ws->status = WEBSOCK_CLOSED;
+  if (ws->closeCb) ws->closeCb(ws);
+  if (ws->priv->txbuffer != NULL) os_free(ws->priv->txbuffer);
+  if (ws->priv->sentbuffer != NULL) os_free(ws->priv->sentbuffer);
+  os_free(ws->priv);
+  os_free(ws);
+}
+
+// Case-insensitive check whether the header value contains the given lower-case token
+static bool ICACHE_FLASH_ATTR
+wsHasToken(const char *hdr, const char *token) {
+  int tl = os_strlen(token);
+  for (; *hdr != 0; hdr++) {
+    int i = 0;
+    while (i < tl && tolower((int)hdr[i]) == token[i]) i++;
+    if (i == tl) return true;
+  }
+  return false;
+}
+
+int ICACHE_FLASH_ATTR
+cgiWebsocket(HttpdConnData *connData) {
+  Websock *ws = connData->cgiData;
+
+  if (connData->conn == NULL) {
+    //Connection aborted. Clean up.
+    if (ws != NULL) wsFree(ws);
+    connData->cgiData = NULL;
+    return HTTPD_CGI_DONE;
+  }
+
+  if (ws != NULL) {
+    // We get called from the sent callback: the previous send completed
+    WebsockPriv *p = ws->priv;
+    if (p->sentbuffer != NULL) os_free(p->sentbuffer);
+    p->sentbuffer = NULL;
+    p->readytosend = true;
+    if (p->txbufferlen > 0) {
+      wsSendTxBuffer(ws);
+    } else if (p->closing) {
+      espconn_disconnect(connData->conn); // we will get a disconnect callback
+    } else if (ws->sentCb) {
+      ws->sentCb(ws);
+    }
+    return HTTPD_CGI_MORE;
+  }
+
+  // First call: perform the handshake
+  char key[64], buff[256];
+  if (connData->requestType != HTTPD_METHOD_GET ||
+      !httpdGetHeader(connData, "Upgrade", buff, sizeof(buff)) || !wsHasToken(buff, "websocket") ||
+      !httpdGetHeader(connData, "Sec-WebSocket-Key", key, sizeof(key) - sizeof(WS_GUID))) {
+    httpdStartResponse(connData, 400);
+    httpdHeader(connData, "Content-Type", "text/plain");
+    httpdEndHeaders(connData);
+    httpdSend(connData, "Websocket upgrade expected\r\n", -1);
+    return HTTPD_CGI_DONE;
+  }
+
+  // Sec-WebSocket-Accept is base64(sha1(key + GUID))
+  Sha1Ctx sha;
+  uint8_t digest[SHA1_HASH_LEN];
+  char accept[32];
+  os_strcat(key, WS_GUID);
+  sha1Init(&sha);
+  sha1Update(&sha, key, os_strlen(key));
+  sha1Final(&sha, digest);
+  base64_encode(SHA1_HASH_LEN, digest, sizeof(accept), accept);
+
+  ws = os_zalloc(sizeof(Websock));
+  if (ws != NULL) ws->priv = os_zalloc(sizeof(WebsockPriv));
+  if (ws == NULL || ws->priv == NULL) {
+    os_printf("Websock: out of memory\n");
+    if (ws != NULL) os_free(ws);
+    httpdStartResponse(connData, 500);
+    httpdEndHeaders(connData);
+    return HTTPD_CGI_DONE;
+  }
+  ws->conn = connData;
+  ws->status = WEBSOCK_OPEN;
+  ws->priv->readytosend = false; // the handshake response goes out first
+  ws->priv->next = wsList;
+  wsList = ws;
+
+  int l = os_sprintf(buff, "HTTP/1.1 101 Switching Protocols\r\nServer: esp-link\r\n"
+      "Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+  httpdSend(connData, buff, l);
+
+  connData->cgiData = ws;
+  connData->recvHdl = wsRecvHdl;
+  espconn_regist_time(connData->conn, WS_TIMEOUT, 1);
+  DBG("Websock: %s open\n", connData->url);
+
+  if (connData->cgiArg != NULL) ((WsConnectedCb)connData->cgiArg)(ws);
+  return HTTPD_CGI_MORE;
+}
@@ -0,0 +1,49 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include "httpd.h"
+
+// Flags passed to the receive callback and to cgiWebsocketSend
+#define WEBSOCK_FLAG_NONE 0
+#define WEBSOCK_FLAG_MORE (1<<0) // more data of the same message follows
+#define WEBSOCK_FLAG_BIN  (1<<1) // binary message (text otherwise)
+#define WEBSOCK_FLAG_CONT (1<<2) // data continues a message started in an earlier call
+
+#define WEBSOCK_CLOSED    0
+#define WEBSOCK_OPEN      1
+
+// Close reasons (RFC 6455 section 7.4.1)
+#define WEBSOCK_CLOSE_NORMAL   1000
+#define WEBSOCK_CLOSE_PROTOCOL 1002
+#define WEBSOCK_CLOSE_TOO_BIG  1009
+
+typedef struct Websock Websock;
+typedef struct WebsockPriv WebsockPriv;
+
+typedef void (* WsConnectedCb)(Websock *ws);
+typedef void (* WsRecvCb)(Websock *ws, char *data, int len, int flags);
+typedef void (* WsSentCb)(Websock *ws);
+typedef void (* WsCloseCb)(Websock *ws);
+
+// A websocket, created by cgiWebsocket once the handshake is done. The connected callback
+// (passed as cgiArg in the url table) is expected to fill-in the callbacks it cares about.
+struct Websock {
+  void          *userData;  // for use by the callbacks
+  HttpdConnData *conn;      // underlying http connection
+  uint8_t       status;     // WEBSOCK_OPEN or WEBSOCK_CLOSED
+  WsRecvCb      recvCb;     // data arrived, may be called several times per message
+  WsSentCb      sentCb;     // all queued data has been sent
+  WsCloseCb     closeCb;    // websocket went away, ws is freed after this returns
+  WebsockPriv   *priv;
+};
+
+// Use as cgi in the url table with a WsConnectedCb as cgiArg
+int cgiWebsocket(HttpdConnData *connData);
+// Queue a message for sending, returns 1 on success, 0 if the send buffer is full
+int cgiWebsocketSend(Websock *ws, const char *data, int len, int flags);
+// Send a close frame and disconnect once it's out
+void cgiWebsocketClose(Websock *ws, int reason);
+// Send a message to all open websockets on the given url, returns number of recipients
+int cgiWebsockBroadcast(const char *resource, const char *data, int len, int flags);
+
+#endif
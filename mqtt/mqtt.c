@@ -32,14 +32,12 @@
 */
 
 // TODO:
-// Handle SessionPresent=0 in CONNACK and rexmit subscriptions
 // Improve timeout for CONNACK, currently only has keep-alive timeout (maybe send artificial ping?)
-// Allow messages that don't require ACK to be sent even when pending_buffer is != NULL
-// Set dup flag in retransmissions
 
 #include <esp8266.h>
 #include "pktbuf.h"
 #include "mqtt.h"
+#include "mqtt_spool.h"
 
 #ifdef MQTT_DBG
 #define DBG_MQTT(format, ...) os_printf(format, ## __VA_ARGS__)
@@ -62,8 +60,12 @@ sint8 espconn_secure_sent(struct espconn *espconn, uint8 *psent, uint16 length)
 
 // max message size supported for receive
 #define MQTT_MAX_RCV_MESSAGE 2048
-// max message size for sending (except publish)
-#define MQTT_MAX_SHORT_MESSAGE 128
+// buffer size for messages consisting of just a message id: fixed header space plus the id
+#define MQTT_ID_MESSAGE_SIZE 5
+// max bytes to coalesce into a single send, one TCP segment (TCP_MSS)
+#define MQTT_MAX_COALESCE 1460
+// max length of a subscription topic filter
+#define MQTT_MAX_FILTER 256
 
 #ifdef MQTT_DBG
 static char* mqtt_msg_type[] = {
@@ -73,25 +75,732 @@ static char* mqtt_msg_type[] = {
 #endif
 
 // forward declarations
-static void mqtt_enq_message(MQTT_Client *client, const uint8_t *data, uint16_t len);
+static void mqtt_enq_message(MQTT_Client *client, PktBuf *buf);
 static void mqtt_send_message(MQTT_Client* client);
 static void mqtt_doAbort(MQTT_Client* client);
 
+// Space a string takes up in a message
+static uint16_t ICACHE_FLASH_ATTR
+mqtt_str_size(const char* str) {
+  return str != NULL && str[0] != '\0' ? 2 + os_strlen(str) : 0;
+}
+
+// Start assembling a message directly in a pooled buffer: msg is pointed at the buffer for
+// the mqtt_msg_* functions, it carries the message_id memo along
+static PktBuf * ICACHE_FLASH_ATTR
+mqtt_msg_start(MQTT_Client* client, mqtt_connection_t* msg, uint16_t size) {
+  PktBuf *buf = PktBuf_New(size);
+  if (buf == NULL) {
+    os_printf("MQTT ERROR: Cannot allocate buffer for %d byte message\n", size);
+    return NULL;
+  }
+  msg->message_id = client->mqtt_connection.message_id;
+  msg->version = client->mqtt_connection.version;
+  msg->buffer = buf->data;
+  msg->buffer_length = buf->size;
+  return buf;
+}
+
+// Finish a message assembled with mqtt_msg_start, frees the buffer and returns NULL if the
+// message didn't fit
+static PktBuf * ICACHE_FLASH_ATTR
+mqtt_msg_finish(MQTT_Client* client, mqtt_connection_t* msg, PktBuf *buf) {
+  if (msg->message.length == 0) {
+    PktBuf_Free(buf);
+    return NULL;
+  }
+  client->mqtt_connection.message_id = msg->message_id;
+  buf->data = msg->message.data; // the fixed header may be shorter than the space reserved
+  buf->filled = msg->message.length;
+  return buf;
+}
+
+// Queue one of the messages that consist of just a message id (PUBACK, PUBREL, etc.)
+static void ICACHE_FLASH_ATTR
+mqtt_enq_id_message(MQTT_Client* client,
+    mqtt_message_t* (*build)(mqtt_connection_t*, uint16_t), uint16_t msg_id) {
+  mqtt_connection_t msg;
+  PktBuf *buf = mqtt_msg_start(client, &msg, MQTT_ID_MESSAGE_SIZE);
+  if (buf == NULL) return;
+  build(&msg, msg_id);
+  if (mqtt_msg_finish(client, &msg, buf) != NULL) mqtt_enq_message(client, buf);
+}
+
+// Determine whether a message needs to be held on to until the broker ACKs it
+static bool ICACHE_FLASH_ATTR
+mqtt_needs_ack(PktBuf *buf) {
+  uint8_t msg_type = mqtt_get_type(buf->data);
+  return (msg_type == MQTT_MSG_TYPE_PUBLISH && mqtt_get_qos(buf->data) > 0) ||
+    msg_type == MQTT_MSG_TYPE_PUBREL || msg_type == MQTT_MSG_TYPE_PUBREC ||
+    msg_type == MQTT_MSG_TYPE_SUBSCRIBE || msg_type == MQTT_MSG_TYPE_UNSUBSCRIBE;
+}
+
+// Max number of messages awaiting an ACK: our window, capped by the broker's Receive Maximum
+static uint16_t ICACHE_FLASH_ATTR
+mqtt_window(MQTT_Client *client) {
+  return client->receiveMax < client->inflightWindow ? client->receiveMax : client->inflightWindow;
+}
+
+// Whether the message at the head of the queue can go out: the socket must be idle and a
+// message that needs an ACK must find a free slot in the in-flight window
+static bool ICACHE_FLASH_ATTR
+mqtt_can_send(MQTT_Client *client) {
+  if (client->sending || client->msgQueue == NULL) return false;
+  return client->inflightCount < mqtt_window(client) || !mqtt_needs_ack(client->msgQueue);
+}
+
+// Free the in-flight message an ACK refers to, returns false if there is none
+static bool ICACHE_FLASH_ATTR
+mqtt_inflight_ack(MQTT_Client *client, uint8_t msg_type, uint16_t msg_id) {
+  for (int i=0; i<client->inflightCount; i++) {
+    PktBuf *buf = client->inflight[i];
+    if (mqtt_get_type(buf->data) != msg_type || mqtt_get_id(buf->data, buf->filled) != msg_id)
+      continue;
+    PktBuf_Free(buf);
+    client->inflightCount--;
+    for (; i<client->inflightCount; i++) client->inflight[i] = client->inflight[i+1];
+    // a spooled publish only leaves the flash once the broker has it
+    if (msg_type == MQTT_MSG_TYPE_PUBLISH && client->spool != NULL)
+      mqtt_spool_ack(client->spool, msg_id);
+    client->timeoutTick = client->sendTimeout+1; // broker is making progress, restart timeout
+    return true;
+  }
+  return false;
+}
+
+// Put all in-flight messages back at the head of the send queue, in the order they were
+// originally sent, so they get retransmitted (publishes with the DUP flag set)
+static void ICACHE_FLASH_ATTR
+mqtt_requeue_inflight(MQTT_Client *client) {
+  while (client->inflightCount > 0) {
+    PktBuf *buf = client->inflight[--client->inflightCount];
+    if (mqtt_get_type(buf->data) == MQTT_MSG_TYPE_PUBLISH) buf->data[0] |= 0x08;
+    client->msgQueue = PktBuf_Unshift(client->msgQueue, buf);
+  }
+}
+
+// Set the message id of a QoS1/2 publish, it follows the topic
+static void ICACHE_FLASH_ATTR
+mqtt_set_publish_id(PktBuf *buf, uint16_t msg_id) {
+  uint8_t *p = buf->data + 1;
+  while (*p++ & 0x80) ; // skip remaining length
+  uint16_t topic_len = (p[0] << 8) | p[1];
+  p += 2 + topic_len;
+  p[0] = msg_id >> 8;
+  p[1] = msg_id & 0xff;
+}
+
+// Move publishes spooled in flash into the empty send queue, as many as the in-flight window
+// has room for so they go out at full speed; they get fresh message ids because the ones they
+// were assembled with may belong to a previous connection or boot
+static void ICACHE_FLASH_ATTR
+mqtt_spool_drain(MQTT_Client *client) {
+  if (client->spool == NULL || client->msgQueue != NULL) return;
+  for (int n=client->inflightCount; n<mqtt_window(client); n++) {
+    uint16_t msg_id = client->mqtt_connection.message_id + 1;
+    if (msg_id == 0) msg_id = 1;
+    PktBuf *buf = mqtt_spool_get(client->spool, msg_id);
+    if (buf == NULL) break;
+    client->mqtt_connection.message_id = msg_id;
+    mqtt_set_publish_id(buf, msg_id);
+    client->msgQueue = PktBuf_Push(client->msgQueue, buf);
+  }
+}
+
+//===== MQTT 5 publish
+
+// Bytes a queued message may take on the wire: publishes are queued in v3.1.1 form and with
+// MQTT 5 get a topic alias and the property length added, which may also lengthen the fixed
+// header by a byte
+static uint16_t ICACHE_FLASH_ATTR
+mqtt_send_size(MQTT_Client *client, PktBuf *buf) {
+  if (client->mqtt_connection.version == MQTT_PROTOCOL_V5 &&
+      mqtt_get_type(buf->data) == MQTT_MSG_TYPE_PUBLISH)
+    return buf->filled + 5;
+  return buf->filled;
+}
+
+// Look up the alias of a topic, assigning it the next free one if it has none, returns 0 if the
+// aliases are used up; known tells whether the broker has been sent the alias already
+static uint16_t ICACHE_FLASH_ATTR
+mqtt_topic_alias(MQTT_Client *client, const char *topic, uint16_t len, bool *known) {
+  *known = false;
+  for (int i=0; i<client->topicAliasMax; i++) {
+    char *t = client->topicAlias[i];
+    if (t == NULL) {
+      t = (char *)os_malloc(len+1);
+      if (t == NULL) return 0;
+      os_memcpy(t, topic, len);
+      t[len] = 0;
+      client->topicAlias[i] = t;
+      return i+1;
+    }
+    if (os_strlen(t) == len && os_memcmp(t, topic, len) == 0) {
+      *known = true;
+      return i+1;
+    }
+  }
+  return 0;
+}
+
+// Forget the topic aliases, they're only valid for one connection
+static void ICACHE_FLASH_ATTR
+mqtt_topic_alias_reset(MQTT_Client *client) {
+  for (int i=0; i<MQTT_MAX_TOPIC_ALIAS; i++) {
+    if (client->topicAlias[i] != NULL) os_free(client->topicAlias[i]);
+    client->topicAlias[i] = NULL;
+  }
+  client->topicAliasMax = 0;
+}
+
+// Append a publish to out in MQTT 5 form: the message id is followed by the properties, and
+// a topic the broker has the alias of already is replaced by the alias
+static void ICACHE_FLASH_ATTR
+mqtt_publish_v5(MQTT_Client *client, PktBuf *buf, PktBuf *out) {
+  uint8_t *p = buf->data + 1;
+  while (*p++ & 0x80) ; // skip remaining length
+  uint16_t topic_len = (p[0] << 8) | p[1];
+  const char *topic = (char *)p + 2;
+  p += 2 + topic_len;
+  uint16_t id_len = mqtt_get_qos(buf->data) > 0 ? 2 : 0;
+  uint16_t data_len = buf->data + buf->filled - (p + id_len);
+
+  bool known;
+  uint16_t alias = mqtt_topic_alias(client, topic, topic_len, &known);
+  if (known) topic_len = 0;
+  uint8_t props = alias > 0 ? 3 : 0;
+
+  uint8_t *o = out->data + out->filled;
+  *o++ = buf->data[0];
+  o += mqtt_put_varint(o, 2 + topic_len + id_len + 1 + props + data_len);
+  *o++ = topic_len >> 8;
+  *o++ = topic_len & 0xff;
+  os_memcpy(o, topic, topic_len);
+  o += topic_len;
+  os_memcpy(o, p, id_len);
+  o += id_len;
+  *o++ = props;
+  if (alias > 0) {
+    *o++ = MQTT_PROP_TOPIC_ALIAS;
+    *o++ = alias >> 8;
+    *o++ = alias & 0xff;
+  }
+  os_memcpy(o, p + id_len, data_len);
+  out->filled = o + data_len - out->data;
+}
+
+//===== subscription table
+
+// Subscription filters are kept in a trie with one node per topic level, the node where a
+// filter ends holds the callbacks registered for it
+typedef struct MqttSubHandler {
+  struct MqttSubHandler *next;
+  MqttDataCallback cb;          // NULL: deliver to the client's dataCb/cmdDataCb
+  uint16_t refs;                // number of times the callback got registered for the filter
+} MqttSubHandler;
+
+typedef struct MqttSubNode {
+  struct MqttSubNode *next;     // next node at the same level
+  struct MqttSubNode *child;    // first node at the next level
+  MqttSubHandler *handlers;     // callbacks of the filter ending here, NULL if none does
+  uint8_t qos;                  // qos the filter ending here is subscribed with
+  bool pending;                 // the filter ending here still needs to go out in a SUBSCRIBE
+  uint16_t len;                 // length of level
+  char level[0];                // topic level, "+" and "#" being wildcards
+} MqttSubNode;
+
+// Incoming publish being matched against the subscription table
+typedef struct {
+  MQTT_Client *client;
+  const char *topic, *data;
+  uint16_t topic_length;
+  uint32_t data_length, offset, total_length;
+  bool matched;                 // some filter matched
+  bool global;                  // a filter without callback matched
+} MqttSubMatch;
+
+static bool ICACHE_FLASH_ATTR
+mqtt_sub_is(MqttSubNode *node, char wildcard) {
+  return node->len == 1 && node->level[0] == wildcard;
+}
+
+// Find the trie node of a filter, optionally creating the missing nodes along the way
+static MqttSubNode * ICACHE_FLASH_ATTR
+mqtt_sub_node(MQTT_Client *client, const char *filter, bool create) {
+  MqttSubNode **list = &client->subs, *node = NULL;
+  const char *level = filter, *end;
+  do {
+    end = os_strchr(level, '/');
+    if (end == NULL) end = level + os_strlen(level);
+    uint16_t len = end - level;
+    for (node = *list; node != NULL; node = node->next)
+      if (node->len == len && os_memcmp(node->level, level, len) == 0) break;
+    if (node == NULL) {
+      if (!create) return NULL;
+      node = (MqttSubNode *)os_zalloc(sizeof(MqttSubNode) + len + 1);
+      if (node == NULL) return NULL;
+      node->len = len;
+      os_memcpy(node->level, level, len);
+      node->next = *list;
+      *list = node;
+    }
+    list = &node->child;
+    level = end + 1;
+  } while (*end != '\0');
+  return node;
+}
+
+// Free the nodes that lead to no filter anymore
+static void ICACHE_FLASH_ATTR
+mqtt_sub_prune(MqttSubNode **list) {
+  while (*list != NULL) {
+    MqttSubNode *node = *list;
+    mqtt_sub_prune(&node->child);
+    if (node->child == NULL && node->handlers == NULL) {
+      *list = node->next;
+      os_free(node);
+    } else {
+      list = &node->next;
+    }
+  }
+}
+
+// Free the whole subscription table
+static void ICACHE_FLASH_ATTR
+mqtt_sub_free(MqttSubNode *node) {
+  while (node != NULL) {
+    MqttSubNode *next = node->next;
+    mqtt_sub_free(node->child);
+    while (node->handlers != NULL) {
+      MqttSubHandler *h = node->handlers;
+      node->handlers = h->next;
+      os_free(h);
+    }
+    os_free(node);
+    node = next;
+  }
+}
+
+// Drop one registration of a callback for a filter, returns true if that was the last
+// registration of the filter, which is then gone from the table
+static bool ICACHE_FLASH_ATTR
+mqtt_sub_remove(MQTT_Client *client, const char *filter, MqttDataCallback cb) {
+  MqttSubNode *node = mqtt_sub_node(client, filter, false);
+  if (node == NULL) return false;
+  for (MqttSubHandler **hp = &node->handlers; *hp != NULL; hp = &(*hp)->next) {
+    MqttSubHandler *h = *hp;
+    if (h->cb != cb) continue;
+    if (--h->refs > 0) return false;
+    *hp = h->next;
+    os_free(h);
+    if (node->handlers != NULL) return false;
+    node->pending = false; // the node may stay for its children, the filter mustn't come back
+    mqtt_sub_prune(&client->subs);
+    return true;
+  }
+  return false;
+}
+
+// Walk of the trie collecting the filters pending a SUBSCRIBE
+typedef struct {
+  mqtt_connection_t *msg;       // message to add the filters to, NULL to just add up their size
+  uint16_t size;                // bytes the filters take up in the message
+  uint16_t count;               // filters added to the message
+  char path[MQTT_MAX_FILTER];   // filter of the current node
+} MqttSubWalk;
+
+// Add the pending filters to the message, returns false when the message is full
+static bool ICACHE_FLASH_ATTR
+mqtt_sub_walk(MqttSubWalk *w, MqttSubNode *list, uint16_t len) {
+  for (MqttSubNode *node = list; node != NULL; node = node->next) {
+    uint16_t plen = len + node->len;
+    if (plen >= MQTT_MAX_FILTER) continue; // can't happen, MQTT_SubscribeCb checks
+    os_memcpy(w->path + len, node->level, node->len);
+    if (node->pending && node->handlers != NULL) {
+      if (w->msg == NULL) {
+        w->size += 2 + plen + 1;
+      } else {
+        if (mqtt_msg_subscribe_topic(w->msg, w->path, plen, node->qos) < 0) return false;
+        node->pending = false;
+        w->count++;
+      }
+    }
+    w->path[plen] = '/';
+    if (!mqtt_sub_walk(w, node->child, plen+1)) return false;
+  }
+  return true;
+}
+
+// Mark all filters as pending, for when the broker didn't keep our session
+static void ICACHE_FLASH_ATTR
+mqtt_sub_mark(MqttSubNode *list) {
+  for (MqttSubNode *node = list; node != NULL; node = node->next) {
+    if (node->handlers != NULL) node->pending = true;
+    mqtt_sub_mark(node->child);
+  }
+}
+
+// Queue SUBSCRIBEs for all pending filters, as few as possible, each up to a TCP segment
+static bool ICACHE_FLASH_ATTR
+mqtt_sub_send(MQTT_Client *client) {
+  if (!client->connAcked) return TRUE; // CONNACK tells whether the broker still has them
+  while (client->subsPending) {
+    MqttSubWalk w;
+    w.msg = NULL;
+    w.size = 0;
+    w.count = 0;
+    mqtt_sub_walk(&w, client->subs, 0);
+    if (w.size == 0) {
+      client->subsPending = false;
+      break;
+    }
+
+    // fixed header, message id, MQTT 5 properties, filters with length and qos
+    uint16_t hdr = client->mqtt_connection.version == MQTT_PROTOCOL_V5 ? 3 + 2 + 1 : 3 + 2;
+    if (w.size > MQTT_MAX_COALESCE-hdr) w.size = MQTT_MAX_COALESCE-hdr;
+    mqtt_connection_t msg;
+    PktBuf *buf = mqtt_msg_start(client, &msg, hdr + w.size);
+    if (buf == NULL) return FALSE;
+    uint16_t msg_id;
+    mqtt_msg_subscribe_init(&msg, &msg_id);
+    w.msg = &msg;
+    mqtt_sub_walk(&w, client->subs, 0);
+    mqtt_msg_subscribe_fini(&msg);
+    if (mqtt_msg_finish(client, &msg, buf) == NULL) {
+      os_printf("MQTT ERROR: Queuing Subscribe failed\n");
+      return FALSE;
+    }
+    DBG_MQTT("MQTT: Subscribe, %d topics\n", w.count);
+    mqtt_enq_message(client, buf);
+  }
+  return TRUE;
+}
+
+// Call the callbacks of a filter that matched
+static void ICACHE_FLASH_ATTR
+mqtt_sub_call(MqttSubMatch *m, MqttSubNode *node) {
+  for (MqttSubHandler *h = node->handlers; h != NULL; h = h->next) {
+    m->matched = true;
+    if (h->cb == NULL)
+      m->global = true;
+    else
+      h->cb(m->client, m->topic, m->topic_length, m->data, m->data_length, m->offset,
+          m->total_length);
+  }
+}
+
+// Match the topic from level on against the nodes of a trie level
+static void ICACHE_FLASH_ATTR
+mqtt_sub_match(MqttSubMatch *m, MqttSubNode *list, const char *level) {
+  const char *end = m->topic + m->topic_length, *next = level;
+  while (next < end && *next != '/') next++;
+  bool sys = level == m->topic && level < end && *level == '$'; // wildcards don't match $SYS...
+
+  for (MqttSubNode *node = list; node != NULL; node = node->next) {
+    if (mqtt_sub_is(node, '#')) {
+      if (!sys) mqtt_sub_call(m, node);
+    } else if (mqtt_sub_is(node, '+') ? !sys :
+        node->len == next - level && os_memcmp(node->level, level, node->len) == 0) {
+      if (next < end) {
+        mqtt_sub_match(m, node->child, next+1);
+      } else {
+        mqtt_sub_call(m, node);
+        // "a/#" also matches "a"
+        for (MqttSubNode *c = node->child; c != NULL; c = c->next)
+          if (mqtt_sub_is(c, '#')) mqtt_sub_call(m, c);
+      }
+    }
+  }
+}
+
+// Deliver (a fragment of) the payload of a publish message to the callbacks of the filters
+// that match its topic, the client's own callbacks get what matches a filter subscribed to
+// without callback or no filter at all
+static void ICACHE_FLASH_ATTR
+deliver_data(MQTT_Client* client, const char* topic, uint16_t topic_length,
+    const char* data, uint32_t data_length, uint32_t offset, uint32_t total_length) {
+  MqttSubMatch m = { client, topic, data, topic_length, data_length, offset, total_length };
+  mqtt_sub_match(&m, client->subs, topic);
+  if (m.matched && !m.global) return;
+
+  if (client->dataCb)
+    client->dataCb(client, topic, topic_length, data, data_length, offset, total_length);
+  if (client->cmdDataCb)
+    client->cmdDataCb(client, topic, topic_length, data, data_length, offset, total_length);
+}
+
 // Deliver a publish message to the client
 static void ICACHE_FLASH_ATTR
 deliver_publish(MQTT_Client* client, uint8_t* message, uint16_t length) {
 
-  // parse the message into topic and data
+  // parse the message into topic and data, with MQTT 5 the data follows the properties
   uint16_t topic_length = length;
   const char *topic = mqtt_get_publish_topic(message, &topic_length);
   uint16_t data_length = length;
-  const char *data = mqtt_get_publish_data(message, &data_length);
+  const char *data;
+  if (client->mqtt_connection.version == MQTT_PROTOCOL_V5) {
+    const uint8_t *props = mqtt_get_publish_props(message, &data_length);
+    if (props == NULL) return;
+    data = (const char *)props + data_length;
+    data_length = message + length - (const uint8_t *)data;
+  } else {
+    data = mqtt_get_publish_data(message, &data_length);
+  }
 
   // callback to client
-  if (client->dataCb)
-    client->dataCb(client, topic, topic_length, data, data_length);
-  if (client->cmdDataCb)
-    client->cmdDataCb(client, topic, topic_length, data, data_length);
+  deliver_data(client, topic, topic_length, data, data_length, 0, data_length);
+}
+
+// Send the PUBACK or PUBREC a received publish calls for
+static void ICACHE_FLASH_ATTR
+mqtt_ack_publish(MQTT_Client* client, uint8_t msg_qos, uint16_t msg_id) {
+  if (msg_qos == 1) mqtt_enq_id_message(client, mqtt_msg_puback, msg_id);
+  if (msg_qos == 2) mqtt_enq_id_message(client, mqtt_msg_pubrec, msg_id);
+}
+
+// Parse the fixed header of a message, returns its total length, 0 if more bytes are needed
+// to tell, or -1 if the remaining-length field is malformed
+static int ICACHE_FLASH_ATTR
+mqtt_msg_length(const uint8_t* buf, int len) {
+  int totlen = 0;
+  for (int i=1; i<len; i++) {
+    if (i > 4) return -1;
+    totlen += (buf[i] & 0x7f) << (7 * (i - 1));
+    if ((buf[i] & 0x80) == 0) return totlen + i + 1;
+  }
+  return 0;
+}
+
+// Returns the length of the fixed plus variable header (topic, message id, and with MQTT 5 the
+// properties) of a publish message, as far as can be told from the bytes buffered: once the
+// lengths are in the buffer it's the real length, before that it's a lower bound
+static int ICACHE_FLASH_ATTR
+mqtt_publish_hdr_length(MQTT_Client* client, const uint8_t* buf, int len) {
+  int i = 1;
+  while (buf[i] & 0x80) i++; // the fixed header is known to be complete
+  i++;
+  if (len < i+2) return i+2;
+  i += 2 + ((buf[i] << 8) | buf[i+1]) + (mqtt_get_qos(buf) > 0 ? 2 : 0);
+  if (client->mqtt_connection.version != MQTT_PROTOCOL_V5) return i;
+
+  uint32_t props;
+  if (len <= i) return i+1;
+  int n = mqtt_get_varint(buf+i, len-i, &props);
+  return n == 0 ? len+1 : i + n + props;
+}
+
+// Pass the bytes at hand of the payload of an oversized publish message on to the clients,
+// in_buffer holds its headers, returns the number of bytes consumed
+static int ICACHE_FLASH_ATTR
+mqtt_stream_publish(MQTT_Client* client, uint8_t* data, int len) {
+  uint8_t *hdr = client->in_buffer;
+  int hdr_len = client->in_buffer_filled;
+  uint32_t n = client->in_stream_len - client->in_stream_pos;
+  if (n > len) n = len;
+
+  uint16_t topic_length = hdr_len;
+  const char *topic = mqtt_get_publish_topic(hdr, &topic_length);
+  deliver_data(client, topic, topic_length, (char *)data, n,
+      client->in_stream_pos, client->in_stream_len);
+  client->in_stream_pos += n;
+
+  if (client->in_stream_pos == client->in_stream_len) {
+    // all delivered, ack it now: if the connection drops half-way the broker resends it all
+    uint8_t msg_qos = mqtt_get_qos(hdr);
+    if (msg_qos > 0) mqtt_ack_publish(client, msg_qos, mqtt_get_id(hdr, hdr_len));
+    client->in_stream_len = 0;
+    client->in_buffer_filled = 0;
+  }
+  return n;
+}
+
+// Length of the fixed header of a complete message
+static int ICACHE_FLASH_ATTR
+mqtt_hdr_length(const uint8_t* msg) {
+  int i = 1;
+  while (msg[i] & 0x80) i++;
+  return i+1;
+}
+
+// Act on the MQTT 5 properties of a CONNACK that tell what the broker allows
+static void ICACHE_FLASH_ATTR
+mqtt_connack_props(MQTT_Client* client, const uint8_t* p, uint16_t len) {
+  uint32_t props, value;
+  uint8_t id;
+  int n = mqtt_get_varint(p, len, &props);
+  if (n == 0 || n + props > len) return;
+  const uint8_t *end = p + n + props;
+  for (p += n; p < end; p += n) {
+    n = mqtt_get_property(p, end - p, &id, &value);
+    if (n == 0) break;
+    switch (id) {
+    case MQTT_PROP_RECEIVE_MAXIMUM:
+      if (value > 0) client->receiveMax = value;
+      break;
+    case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+      client->topicAliasMax = value < MQTT_MAX_TOPIC_ALIAS ? value : MQTT_MAX_TOPIC_ALIAS;
+      break;
+    case MQTT_PROP_SERVER_KEEP_ALIVE:
+      // the broker's value only holds for this connection, the next CONNECT asks for ours again
+      client->keepAlive = value < MQTT_MAX_KEEPALIVE ? value : MQTT_MAX_KEEPALIVE;
+      client->keepAliveTick = client->keepAlive > 0 ? client->keepAlive+1 : 0;
+      break;
+    }
+  }
+  DBG_MQTT("MQTT: Broker allows %d in flight, %d topic aliases\n", client->receiveMax,
+      client->topicAliasMax);
+}
+
+// Returns the first failure reason code (>= 0x80) of an ack, 0 if all went well: a SUBACK has
+// one per filter, as does an MQTT 5 UNSUBACK, and an MQTT 5 PUBACK or PUBREC may have one
+static uint8_t ICACHE_FLASH_ATTR
+mqtt_ack_reason(MQTT_Client* client, const uint8_t* msg, uint16_t len) {
+  uint8_t msg_type = mqtt_get_type(msg);
+  int i = mqtt_hdr_length(msg) + 2; // skip the message id
+  if (client->mqtt_connection.version != MQTT_PROTOCOL_V5) {
+    if (msg_type != MQTT_MSG_TYPE_SUBACK) return 0;
+  } else if (msg_type == MQTT_MSG_TYPE_SUBACK || msg_type == MQTT_MSG_TYPE_UNSUBACK) {
+    uint32_t props; // the reason codes follow the properties
+    int n = i < len ? mqtt_get_varint(msg+i, len-i, &props) : 0;
+    if (n == 0) return 0;
+    i += n + props;
+  } else {
+    return i < len && msg[i] >= 0x80 ? msg[i] : 0;
+  }
+  for (; i < len; i++)
+    if (msg[i] >= 0x80) return msg[i];
+  return 0;
+}
+
+// Act on one complete message received from the broker, returns false if the connection
+// got aborted and nothing further should be processed
+static bool ICACHE_FLASH_ATTR
+mqtt_process_message(MQTT_Client* client, uint8_t* msg, uint16_t msg_len) {
+  if (client->connState != MQTT_CONNECTED) {
+    // why are we receiving something??
+    DBG_MQTT("MQTT ERROR: recv in invalid state %d\n", client->connState);
+    mqtt_doAbort(client);
+    return false;
+  }
+
+  // we are connected and are sending/receiving data messages
+  uint8_t msg_type = mqtt_get_type(msg);
+  uint16_t msg_id = mqtt_get_id(msg, msg_len);
+  uint8_t reason;
+  DBG_MQTT("MQTT: Recv type=%s id=%04X len=%d; %d in flight\n",
+      mqtt_msg_type[msg_type], msg_id, msg_len, client->inflightCount);
+
+  switch (msg_type) {
+  case MQTT_MSG_TYPE_CONNACK: {
+    // flags and return code (reason code with MQTT 5), then MQTT 5 properties
+    int i = mqtt_hdr_length(msg);
+    if (msg_len < i+2 || msg[i+1] != 0) {
+      os_printf("MQTT: Connection refused, code 0x%02X\n", msg_len < i+2 ? 0xff : msg[i+1]);
+      mqtt_doAbort(client);
+      return false;
+    }
+    //DBG_MQTT("MQTT: Connect successful\n");
+    if (client->mqtt_connection.version == MQTT_PROTOCOL_V5)
+      mqtt_connack_props(client, msg+i+2, msg_len-i-2);
+    // unless the broker kept our session the subscriptions need to be made afresh
+    if ((msg[i] & 0x01) == 0) {
+      mqtt_sub_mark(client->subs);
+      client->subsPending = client->subs != NULL;
+    }
+    client->connAcked = true;
+    mqtt_sub_send(client);
+    // callbacks for internal and external clients
+    if (client->connectedCb) client->connectedCb(client);
+    if (client->cmdConnectedCb) client->cmdConnectedCb(client);
+    client->reconTimeout = 1; // reset the reconnect backoff
+    if (client->down) {
+      // system_get_time wraps after 71 minutes, the seconds count covers longer outages
+      uint32_t ms = (system_get_time() - client->downSince) / 1000;
+      if (client->downTicks > 4000) ms = client->downTicks * 1000;
+      client->down = false;
+      client->reconnects++;
+      client->reconLastMs = ms;
+      if (ms > client->reconMaxMs) client->reconMaxMs = ms;
+      client->reconSumMs += ms;
+      os_printf("MQTT: Reconnected after %lu ms\n", (unsigned long)ms);
+    }
+    break;
+  }
+
+  case MQTT_MSG_TYPE_SUBACK:
+    if (mqtt_inflight_ack(client, MQTT_MSG_TYPE_SUBSCRIBE, msg_id)) {
+      //DBG_MQTT("MQTT: Subscribe successful\n");
+      if ((reason = mqtt_ack_reason(client, msg, msg_len)) != 0)
+        os_printf("MQTT ERROR: Subscribe %04X refused, code 0x%02X\n", msg_id, reason);
+    }
+    break;
+
+  case MQTT_MSG_TYPE_UNSUBACK:
+    if (mqtt_inflight_ack(client, MQTT_MSG_TYPE_UNSUBSCRIBE, msg_id)) {
+      //DBG_MQTT("MQTT: Unsubscribe successful\n");
+      if ((reason = mqtt_ack_reason(client, msg, msg_len)) != 0)
+        os_printf("MQTT ERROR: Unsubscribe %04X refused, code 0x%02X\n", msg_id, reason);
+    }
+    break;
+
+  case MQTT_MSG_TYPE_PUBACK: // ack for a publish we sent
+    if (mqtt_inflight_ack(client, MQTT_MSG_TYPE_PUBLISH, msg_id)) {
+      //DBG_MQTT("MQTT: QoS1 Publish successful\n");
+      if ((reason = mqtt_ack_reason(client, msg, msg_len)) != 0)
+        os_printf("MQTT ERROR: Publish %04X refused, code 0x%02X\n", msg_id, reason);
+    }
+    break;
+
+  case MQTT_MSG_TYPE_PUBREC: // rec for a publish we sent
+    if (mqtt_inflight_ack(client, MQTT_MSG_TYPE_PUBLISH, msg_id)) {
+      //DBG_MQTT("MQTT: QoS2 publish cont\n");
+      // we need to send PUBREL, unless the broker refused the publish which ends the exchange
+      if ((reason = mqtt_ack_reason(client, msg, msg_len)) != 0)
+        os_printf("MQTT ERROR: Publish %04X refused, code 0x%02X\n", msg_id, reason);
+      else
+        mqtt_enq_id_message(client, mqtt_msg_pubrel, msg_id);
+    }
+    break;
+
+  case MQTT_MSG_TYPE_PUBCOMP: // comp for a pubrel we sent (originally publish we sent)
+    if (mqtt_inflight_ack(client, MQTT_MSG_TYPE_PUBREL, msg_id)) {
+      //DBG_MQTT("MQTT: QoS2 Publish successful\n");
+    }
+    break;
+
+  case MQTT_MSG_TYPE_PUBLISH: { // incoming publish
+      // we may need to ACK the publish
+      uint8_t msg_qos = mqtt_get_qos(msg);
+#ifdef MQTT_DBG
+      uint16_t topic_length = msg_len;
+      os_printf("MQTT: Recv PUBLISH qos=%d %s\n", msg_qos,
+          mqtt_get_publish_topic(msg, &topic_length));
+#endif
+      mqtt_ack_publish(client, msg_qos, msg_id);
+      // send the publish message to clients
+      deliver_publish(client, msg, msg_len);
+    }
+    break;
+
+  case MQTT_MSG_TYPE_PUBREL: // rel for a rec we sent (originally publish received)
+    //DBG_MQTT("MQTT: Cont QoS2 recv\n");
+    mqtt_inflight_ack(client, MQTT_MSG_TYPE_PUBREC, msg_id);
+    // we need to send PUBCOMP, also if our PUBREC got acked before a reconnect
+    mqtt_enq_id_message(client, mqtt_msg_pubcomp, msg_id);
+    break;
+
+  case MQTT_MSG_TYPE_PINGRESP:
+    client->keepAliveAckTick = 0;
+    break;
+
+  case MQTT_MSG_TYPE_DISCONNECT: { // MQTT 5 broker closing the connection, with a reason code
+    int i = mqtt_hdr_length(msg);
+    os_printf("MQTT: Disconnected by broker, code 0x%02X\n", i < msg_len ? msg[i] : 0);
+    mqtt_doAbort(client);
+    return false;
+  }
+  }
+  return true;
 }
 
 /**
@@ -104,153 +813,80 @@ deliver_publish(MQTT_Client* client, uint8_t* message, uint16_t length) {
 static void ICACHE_FLASH_ATTR
 mqtt_tcpclient_recv(void* arg, char* pdata, unsigned short len) {
   //os_printf("MQTT: recv CB\n");
-  uint8_t msg_type;
-  uint16_t msg_id;
-  uint16_t msg_len;
-
   struct espconn* pCon = (struct espconn*)arg;
   MQTT_Client* client = (MQTT_Client *)pCon->reverse;
   if (client == NULL) return; // aborted connection
 
   //os_printf("MQTT: Data received %d bytes\n", len);
+  uint8_t *data = (uint8_t *)pdata;
+
+  while (len > 0) {
+    uint8_t *msg;
+    int msg_len;
+
+    if (client->in_stream_len > 0) {
+      // in the middle of an oversized publish, pass its payload through as it arrives
+      int n = mqtt_stream_publish(client, data, len);
+      data += n;
+      len -= n;
+      continue;
+    }
 
-  do {
-    // append data to our buffer
-    int avail = client->in_buffer_size - client->in_buffer_filled;
-    if (len <= avail) {
-      os_memcpy(client->in_buffer + client->in_buffer_filled, pdata, len);
-      client->in_buffer_filled += len;
-      len = 0;
-    } else {
-      os_memcpy(client->in_buffer + client->in_buffer_filled, pdata, avail);
-      client->in_buffer_filled += avail;
-      len -= avail;
-      pdata += avail;
+    if (client->in_buffer_filled == 0) {
+      // nothing buffered: process the message in place if it's all in this segment
+      msg_len = mqtt_msg_length(data, len);
+      if (msg_len > 0 && msg_len <= len) {
+        msg = data;
+        data += msg_len;
+        len -= msg_len;
+        if (!mqtt_process_message(client, msg, msg_len)) return;
+        continue;
+      }
     }
 
-    // check out what's at the head of the buffer
-    msg_type = mqtt_get_type(client->in_buffer);
-    msg_id = mqtt_get_id(client->in_buffer, client->in_buffer_size);
-    msg_len = mqtt_get_total_length(client->in_buffer, client->in_buffer_size);
+    // accumulate a partial message in in_buffer: first enough for the fixed header, then
+    // exactly the rest of the message so the buffer never holds more than one; of a publish
+    // that's too long for the buffer only the headers are accumulated and the payload streamed
+    msg_len = mqtt_msg_length(client->in_buffer, client->in_buffer_filled);
+    bool stream = msg_len > client->in_buffer_size &&
+      mqtt_get_type(client->in_buffer) == MQTT_MSG_TYPE_PUBLISH;
+    int need = stream ? mqtt_publish_hdr_length(client, client->in_buffer, client->in_buffer_filled) :
+      msg_len > 0 ? msg_len : client->in_buffer_filled + 1;
 
-    if (msg_len > client->in_buffer_size) {
+    if (msg_len < 0 || need > client->in_buffer_size) {
       // oops, too long a message for us to digest, disconnect and hope for a miracle
       os_printf("MQTT: Too long a message (%d bytes)\n", msg_len);
       mqtt_doAbort(client);
       return;
     }
 
-    // check whether what's left in the buffer is a complete message
-    if (msg_len > client->in_buffer_filled) break;
-
-    if (client->connState != MQTT_CONNECTED) {
-      // why are we receiving something??
-      DBG_MQTT("MQTT ERROR: recv in invalid state %d\n", client->connState);
-      mqtt_doAbort(client);
-      return;
-    }
-
-    // we are connected and are sending/receiving data messages
-    uint8_t pending_msg_type = 0;
-    uint16_t pending_msg_id = 0;
-    if (client->pending_buffer != NULL) {
-      pending_msg_type = mqtt_get_type(client->pending_buffer->data);
-      pending_msg_id = mqtt_get_id(client->pending_buffer->data, client->pending_buffer->filled);
-    }
-    DBG_MQTT("MQTT: Recv type=%s id=%04X len=%d; Pend type=%s id=%02X\n",
-        mqtt_msg_type[msg_type], msg_id, msg_len, mqtt_msg_type[pending_msg_type],pending_msg_id);
-
-    switch (msg_type) {
-    case MQTT_MSG_TYPE_CONNACK:
-      //DBG_MQTT("MQTT: Connect successful\n");
-      // callbacks for internal and external clients
-      if (client->connectedCb) client->connectedCb(client);
-      if (client->cmdConnectedCb) client->cmdConnectedCb(client);
-      client->reconTimeout = 1; // reset the reconnect backoff
-      break;
-
-    case MQTT_MSG_TYPE_SUBACK:
-      if (pending_msg_type == MQTT_MSG_TYPE_SUBSCRIBE && pending_msg_id == msg_id) {
-        //DBG_MQTT("MQTT: Subscribe successful\n");
-        client->pending_buffer = PktBuf_ShiftFree(client->pending_buffer);
-      }
-      break;
-
-    case MQTT_MSG_TYPE_UNSUBACK:
-      if (pending_msg_type == MQTT_MSG_TYPE_UNSUBSCRIBE && pending_msg_id == msg_id) {
-        //DBG_MQTT("MQTT: Unsubscribe successful\n");
-        client->pending_buffer = PktBuf_ShiftFree(client->pending_buffer);
-      }
-      break;
-
-    case MQTT_MSG_TYPE_PUBACK: // ack for a publish we sent
-      if (pending_msg_type == MQTT_MSG_TYPE_PUBLISH && pending_msg_id == msg_id) {
-        //DBG_MQTT("MQTT: QoS1 Publish successful\n");
-        client->pending_buffer = PktBuf_ShiftFree(client->pending_buffer);
-      }
-      break;
-
-    case MQTT_MSG_TYPE_PUBREC: // rec for a publish we sent
-      if (pending_msg_type == MQTT_MSG_TYPE_PUBLISH && pending_msg_id == msg_id) {
-        //DBG_MQTT("MQTT: QoS2 publish cont\n");
-        client->pending_buffer = PktBuf_ShiftFree(client->pending_buffer);
-        // we need to send PUBREL
-        mqtt_msg_pubrel(&client->mqtt_connection, msg_id);
-        mqtt_enq_message(client, client->mqtt_connection.message.data,
-            client->mqtt_connection.message.length);
-      }
-      break;
-
-    case MQTT_MSG_TYPE_PUBCOMP: // comp for a pubrel we sent (originally publish we sent)
-      if (pending_msg_type == MQTT_MSG_TYPE_PUBREL && pending_msg_id == msg_id) {
-        //DBG_MQTT("MQTT: QoS2 Publish successful\n");
-        client->pending_buffer = PktBuf_ShiftFree(client->pending_buffer);
+    int want = need - client->in_buffer_filled;
+    if (want > len) want = len;
+    os_memcpy(client->in_buffer + client->in_buffer_filled, data, want);
+    client->in_buffer_filled += want;
+    data += want;
+    len -= want;
+    if (client->in_buffer_filled < need) continue;
+
+    if (stream) {
+      // once the topic length is known the header length may have grown
+      if (need < mqtt_publish_hdr_length(client, client->in_buffer, client->in_buffer_filled)) continue;
+      if (client->connState != MQTT_CONNECTED) {
+        mqtt_process_message(client, client->in_buffer, need); // aborts
+        return;
       }
-      break;
-
-    case MQTT_MSG_TYPE_PUBLISH: { // incoming publish
-        // we may need to ACK the publish
-        uint8_t msg_qos = mqtt_get_qos(client->in_buffer);
-#ifdef MQTT_DBG
-        uint16_t topic_length = msg_len;
-        os_printf("MQTT: Recv PUBLISH qos=%d %s\n", msg_qos,
-            mqtt_get_publish_topic(client->in_buffer, &topic_length));
-#endif
-        if (msg_qos == 1) mqtt_msg_puback(&client->mqtt_connection, msg_id);
-        if (msg_qos == 2) mqtt_msg_pubrec(&client->mqtt_connection, msg_id);
-        if (msg_qos == 1 || msg_qos == 2) {
-          mqtt_enq_message(client, client->mqtt_connection.message.data,
-              client->mqtt_connection.message.length);
-        }
-        // send the publish message to clients
-        deliver_publish(client, client->in_buffer, msg_len);
-      }
-      break;
-
-    case MQTT_MSG_TYPE_PUBREL: // rel for a rec we sent (originally publish received)
-      if (pending_msg_type == MQTT_MSG_TYPE_PUBREC && pending_msg_id == msg_id) {
-        //DBG_MQTT("MQTT: Cont QoS2 recv\n");
-        client->pending_buffer = PktBuf_ShiftFree(client->pending_buffer);
-        // we need to send PUBCOMP
-        mqtt_msg_pubcomp(&client->mqtt_connection, msg_id);
-        mqtt_enq_message(client, client->mqtt_connection.message.data,
-            client->mqtt_connection.message.length);
-      }
-      break;
-
-    case MQTT_MSG_TYPE_PINGRESP:
-      client->keepAliveAckTick = 0;
-      break;
+      client->in_stream_len = msg_len - need;
+      client->in_stream_pos = 0;
+      DBG_MQTT("MQTT: Recv PUBLISH of %d bytes, streaming\n", msg_len);
+    } else if (msg_len > 0) {
+      client->in_buffer_filled = 0;
+      if (!mqtt_process_message(client, client->in_buffer, msg_len)) return;
     }
-
-    // Shift out the message and see whether we have another one
-    if (msg_len < client->in_buffer_filled)
-      os_memcpy(client->in_buffer, client->in_buffer+msg_len, client->in_buffer_filled-msg_len);
-    client->in_buffer_filled -= msg_len;
-  } while(client->in_buffer_filled > 0 || len > 0);
+  }
 
   // Send next packet out, if possible
-  if (!client->sending && client->pending_buffer == NULL && client->msgQueue != NULL) {
+  mqtt_spool_drain(client);
+  if (mqtt_can_send(client)) {
     mqtt_send_message(client);
   }
 }
@@ -272,18 +908,71 @@ mqtt_tcpclient_sent_cb(void* arg) {
   if (client->sending_buffer != NULL) {
     PktBuf *buf = client->sending_buffer;
     //DBG_MQTT("PktBuf free %p l=%d\n", buf, buf->filled);
-    os_free(buf);
+    PktBuf_Free(buf);
     client->sending_buffer = NULL;
   }
   client->sending = false;
 
-  // send next message if one is queued and we're not expecting an ACK
-  if (client->connState == MQTT_CONNECTED && client->pending_buffer == NULL &&
-      client->msgQueue != NULL) {
+  // send next message if one is queued and the in-flight window has room
+  if (client->connState != MQTT_CONNECTED) return;
+  mqtt_sub_send(client); // subscriptions made while we were sending
+  mqtt_spool_drain(client);
+  if (mqtt_can_send(client)) {
     mqtt_send_message(client);
   }
 }
 
+// Free the espconn of a connection attempt that failed before any callback got registered
+static void ICACHE_FLASH_ATTR
+mqtt_free_pcon(MQTT_Client* client) {
+  os_free(client->pCon->proto.tcp);
+  os_free(client->pCon);
+  client->pCon = NULL;
+}
+
+// Schedule a reconnect attempt: the back-off doubles with every failed attempt up to
+// MQTT_MAX_BACKOFF, and half of it is random so a fleet of devices that lost the broker at
+// the same time doesn't come back in lockstep
+static void ICACHE_FLASH_ATTR
+mqtt_reconnect_later(MQTT_Client* client) {
+  if (client->connAcked) {
+    // the connection got lost, time how long it takes to get it back
+    client->connAcked = FALSE;
+    client->dnsFails = 0;
+    if (!client->down) {
+      client->down = true;
+      client->downSince = system_get_time();
+      client->downTicks = 0;
+    }
+  } else if (client->dnsTtl > 0 && ++client->dnsFails >= MQTT_DNS_RETRIES) {
+    client->dnsTtl = 0; // the cached address keeps failing, the broker may have moved
+  }
+
+  uint8_t backoff = client->reconTimeout;
+  client->timeoutTick = backoff/2 + 1 + os_random() % (backoff - backoff/2 + 1);
+  client->reconTimeout = backoff < MQTT_MAX_BACKOFF/2 ? backoff*2 : MQTT_MAX_BACKOFF;
+  client->connState = TCP_RECONNECT_REQ; // the timer will kick-off a reconnection
+  DBG_MQTT("MQTT: Reconnect in %d seconds\n", client->timeoutTick);
+}
+
+// Open the TCP connection to the broker's address
+static void ICACHE_FLASH_ATTR
+mqtt_tcp_connect(MQTT_Client* client, ip_addr_t* ip) {
+  os_memcpy(client->pCon->proto.tcp->remote_ip, &ip->addr, 4);
+  sint8 err;
+  if (client->security)
+    err = espconn_secure_connect(client->pCon);
+  else
+    err = espconn_connect(client->pCon);
+  if (err != 0) {
+    os_printf("MQTT ERROR: Failed to connect\n");
+    mqtt_free_pcon(client);
+    mqtt_reconnect_later(client);
+  } else {
+    DBG_MQTT("MQTT: connecting...\n");
+  }
+}
+
 /*
  * @brief: Timer function to handle timeouts
  */
@@ -291,16 +980,17 @@ static void ICACHE_FLASH_ATTR
 mqtt_timer(void* arg) {
   MQTT_Client* client = (MQTT_Client*)arg;
   //DBG_MQTT("MQTT: timer CB\n");
+  if (client->dnsTtl > 0) client->dnsTtl--;
+  if (client->down && client->downTicks < 0xffff) client->downTicks++;
 
   switch (client->connState) {
   default: break;
 
   case MQTT_CONNECTED:
     // first check whether we're timing out for an ACK
-    if (client->pending_buffer != NULL && --client->timeoutTick == 0) {
+    if (client->inflightCount > 0 && --client->timeoutTick == 0) {
       // looks like we're not getting a response in time, abort the connection
       mqtt_doAbort(client);
-      client->timeoutTick = 0; // trick to make reconnect happen in 1 second
       return;
     }
 
@@ -315,14 +1005,15 @@ mqtt_timer(void* arg) {
     if (client->keepAliveTick > 0 && --client->keepAliveTick == 0) {
       // timeout: we need to send a ping message
       //DBG_MQTT("MQTT: Send keepalive\n");
-      mqtt_msg_pingreq(&client->mqtt_connection);
-      PktBuf *buf = PktBuf_New(client->mqtt_connection.message.length);
-      os_memcpy(buf->data, client->mqtt_connection.message.data,
-          client->mqtt_connection.message.length);
-      buf->filled = client->mqtt_connection.message.length;
-      client->msgQueue = PktBuf_Unshift(client->msgQueue, buf);
-      mqtt_send_message(client);
-      client->keepAliveTick = client->connect_info.keepalive;
+      mqtt_connection_t msg;
+      PktBuf *buf = mqtt_msg_start(client, &msg, MQTT_ID_MESSAGE_SIZE);
+      if (buf != NULL) {
+        mqtt_msg_pingreq(&msg);
+        mqtt_msg_finish(client, &msg, buf);
+        client->msgQueue = PktBuf_Unshift(client->msgQueue, buf);
+        mqtt_send_message(client);
+      }
+      client->keepAliveTick = client->keepAlive;
       client->keepAliveAckTick = client->sendTimeout;
     }
 
@@ -330,11 +1021,7 @@ mqtt_timer(void* arg) {
 
   case TCP_RECONNECT_REQ:
     if (client->timeoutTick == 0 || --client->timeoutTick == 0) {
-      // it's time to reconnect! start by re-enqueueing anything pending
-      if (client->pending_buffer != NULL) {
-        client->msgQueue = PktBuf_Unshift(client->msgQueue, client->pending_buffer);
-        client->pending_buffer = NULL;
-      }
+      // it's time to reconnect! MQTT_Connect re-enqueues anything in flight
       client->connect_info.clean_session = 0; // ask server to keep state
       MQTT_Connect(client);
     }
@@ -362,9 +1049,7 @@ mqtt_tcpclient_discon_cb(void* arg) {
 
   // reconnect unless we're in a permanently disconnected state
   if (client->connState == MQTT_DISCONNECTED) return;
-  client->timeoutTick = client->reconTimeout;
-  if (client->reconTimeout < 128) client->reconTimeout <<= 1;
-  client->connState = TCP_RECONNECT_REQ;
+  mqtt_reconnect_later(client);
 }
 
 /**
@@ -385,10 +1070,7 @@ mqtt_tcpclient_recon_cb(void* arg, int8_t err) {
 
   // reconnect unless we're in a permanently disconnected state
   if (client->connState == MQTT_DISCONNECTED) return;
-  client->timeoutTick = client->reconTimeout;
-  if (client->reconTimeout < 128) client->reconTimeout <<= 1;
-  client->connState = TCP_RECONNECT_REQ;
-  os_printf("timeoutTick=%d reconTimeout=%d\n", client->timeoutTick, client->reconTimeout);
+  mqtt_reconnect_later(client);
 }
 
 
@@ -409,81 +1091,124 @@ mqtt_tcpclient_connect_cb(void* arg) {
   os_printf("MQTT: TCP connected to %s:%d\n", client->host, client->port);
 
   // send MQTT connect message to broker
-  mqtt_msg_connect(&client->mqtt_connection, &client->connect_info);
-  PktBuf *buf = PktBuf_New(client->mqtt_connection.message.length);
-  os_memcpy(buf->data, client->mqtt_connection.message.data,
-      client->mqtt_connection.message.length);
-  buf->filled = client->mqtt_connection.message.length;
+  mqtt_connect_info_t *info = &client->connect_info;
+  // fixed and variable header, MQTT 5 properties, then the strings, each with a length prefix
+  uint16_t size = 3 + 10 + (client->mqtt_connection.version == MQTT_PROTOCOL_V5 ? 7 : 0) +
+    mqtt_str_size(info->client_id) +
+    mqtt_str_size(info->will_topic) + mqtt_str_size(info->will_message) +
+    mqtt_str_size(info->username) + mqtt_str_size(info->password);
+  mqtt_connection_t msg;
+  PktBuf *buf = mqtt_msg_start(client, &msg, size);
+  if (buf != NULL) {
+    mqtt_msg_connect(&msg, info);
+    buf = mqtt_msg_finish(client, &msg, buf);
+  }
+  if (buf == NULL) {
+    os_printf("MQTT ERROR: Cannot assemble connect message\n");
+    mqtt_doAbort(client);
+    return;
+  }
   client->msgQueue = PktBuf_Unshift(client->msgQueue, buf); // prepend to send (rexmit) queue
   mqtt_send_message(client);
   client->connState = MQTT_CONNECTED; // v3.1.1 allows publishing while still connecting
 }
 
 /**
- * @brief  Allocate and enqueue mqtt message, kick sending, if appropriate
+ * @brief  Enqueue mqtt message, kick sending, if appropriate
  */
 static void ICACHE_FLASH_ATTR
-mqtt_enq_message(MQTT_Client *client, const uint8_t *data, uint16_t len) {
-  PktBuf *buf = PktBuf_New(len);
-  os_memcpy(buf->data, data, len);
-  buf->filled = len;
+mqtt_enq_message(MQTT_Client *client, PktBuf *buf) {
   client->msgQueue = PktBuf_Push(client->msgQueue, buf);
 
-  if (client->connState == MQTT_CONNECTED && !client->sending && client->pending_buffer == NULL) {
+  if (client->connState == MQTT_CONNECTED && mqtt_can_send(client)) {
     mqtt_send_message(client);
   }
 }
 
 /**
- * @brief  Send out top message in queue onto socket
+ * @brief  Send out the messages at the head of the queue onto socket, as many as fit into
+ *         one TCP segment so small publishes and acks don't each cost a round-trip
  */
 static void ICACHE_FLASH_ATTR
 mqtt_send_message(MQTT_Client* client) {
   //DBG_MQTT("MQTT: Send_message\n");
-  PktBuf *buf = client->msgQueue;
-  if (buf == NULL || client->sending) return; // ahem...
-  client->msgQueue = PktBuf_Shift(client->msgQueue);
+  if (!mqtt_can_send(client)) return; // ahem...
+
+  // figure out how many queued messages we can send in one go
+  uint16_t len = 0;
+  int count = 0;
+  uint8_t inflight = client->inflightCount;
+  bool convert = false;
+  for (PktBuf *b = client->msgQueue; b != NULL; b = b->next) {
+    uint16_t size = mqtt_send_size(client, b);
+    if (count > 0 && len + size > MQTT_MAX_COALESCE) break;
+    if (mqtt_needs_ack(b)) {
+      if (inflight >= mqtt_window(client)) break;
+      inflight++;
+    }
+    convert |= size != b->filled;
+    len += size;
+    count++;
+  }
 
-  // get some details about the message
-  uint16_t msg_type = mqtt_get_type(buf->data);
-  uint8_t  msg_id = mqtt_get_id(buf->data, buf->filled);
+  // a single message goes out from its own buffer, multiple get copied into a fresh one, as
+  // does an MQTT 5 publish
+  PktBuf *out = count > 1 || convert ? PktBuf_New(len) : NULL;
+  if (out == NULL) {
+    // just the first message then, which may still need a buffer of its own
+    uint16_t size = mqtt_send_size(client, client->msgQueue);
+    out = size == client->msgQueue->filled ? client->msgQueue : PktBuf_New(size);
+    if (out == NULL) return; // out of memory, the keep-alive ping gets things going again
+    count = 1;
+  }
+  client->sending_buffer = out != client->msgQueue ? out : NULL;
+
+  for (int i=0; i<count; i++) {
+    PktBuf *buf = client->msgQueue;
+    client->msgQueue = PktBuf_Shift(client->msgQueue);
+
+    // get some details about the message
 #ifdef MQTT_DBG
-  os_printf("MQTT: Send type=%s id=%04X len=%d\n", mqtt_msg_type[msg_type], msg_id, buf->filled);
+    uint16_t msg_type = mqtt_get_type(buf->data);
+    uint16_t msg_id = mqtt_get_id(buf->data, buf->filled);
+    os_printf("MQTT: Send type=%s id=%04X len=%d (%d/%d)\n", mqtt_msg_type[msg_type], msg_id,
+        buf->filled, i+1, count);
 #if 0
-  for (int i=0; i<buf->filled; i++) {
-    if (buf->data[i] >= ' ' && buf->data[i] <= '~') os_printf("%c", buf->data[i]);
-    else os_printf("\\x%02X", buf->data[i]);
-  }
-  os_printf("\n");
+    for (int j=0; j<buf->filled; j++) {
+      if (buf->data[j] >= ' ' && buf->data[j] <= '~') os_printf("%c", buf->data[j]);
+      else os_printf("\\x%02X", buf->data[j]);
+    }
+    os_printf("\n");
 #endif
 #endif
+    if (out != buf && mqtt_send_size(client, buf) != buf->filled) {
+      mqtt_publish_v5(client, buf, out);
+    } else if (out != buf) {
+      os_memcpy(out->data + out->filled, buf->data, buf->filled);
+      out->filled += buf->filled;
+    }
+
+    // depending on whether it needs an ack we need to hold on to the message
+    // (PINGREQ is acked too but we don't need to rexmit that one)
+    if (mqtt_needs_ack(buf)) {
+      // remember for rexmit on disconnect/reconnect, the timeout runs from the oldest message
+      if (client->inflightCount == 0)
+        client->timeoutTick = client->sendTimeout+1; // +1 to ensure full sendTimeout seconds
+      client->inflight[client->inflightCount++] = buf;
+    } else if (out != buf) {
+      PktBuf_Free(buf); // its bytes are in the coalesced buffer now
+    } else {
+      client->sending_buffer = buf;
+    }
+  }
 
-  // send the message out
+  // send the message(s) out
   if (client->security)
-    espconn_secure_sent(client->pCon, buf->data, buf->filled);
+    espconn_secure_sent(client->pCon, out->data, out->filled);
   else
-    espconn_sent(client->pCon, buf->data, buf->filled);
+    espconn_sent(client->pCon, out->data, out->filled);
   client->sending = true;
-
-  // depending on whether it needs an ack we need to hold on to the message
-  bool needsAck =
-    (msg_type == MQTT_MSG_TYPE_PUBLISH && mqtt_get_qos(buf->data) > 0) ||
-    msg_type == MQTT_MSG_TYPE_PUBREL || msg_type == MQTT_MSG_TYPE_PUBREC ||
-    msg_type == MQTT_MSG_TYPE_SUBSCRIBE || msg_type == MQTT_MSG_TYPE_UNSUBSCRIBE ||
-    msg_type == MQTT_MSG_TYPE_PINGREQ;
-  if (msg_type == MQTT_MSG_TYPE_PINGREQ) {
-    client->pending_buffer = NULL; // we don't need to rexmit this one
-    client->sending_buffer = buf;
-  } else if (needsAck) {
-    client->pending_buffer = buf;  // remeber for rexmit on disconnect/reconnect
-    client->sending_buffer = NULL;
-    client->timeoutTick = client->sendTimeout+1; // +1 to ensure full sendTireout seconds
-  } else {
-    client->pending_buffer = NULL;
-    client->sending_buffer = buf;
-    client->timeoutTick = 0;
-  }
-  client->keepAliveTick = client->connect_info.keepalive > 0 ? client->connect_info.keepalive+1 : 0;
+  client->keepAliveTick = client->keepAlive > 0 ? client->keepAlive+1 : 0;
 }
 
 /**
@@ -494,13 +1219,12 @@ mqtt_dns_found(const char* name, ip_addr_t* ipaddr, void* arg) {
   struct espconn* pConn = (struct espconn *)arg;
   MQTT_Client* client = (MQTT_Client *)pConn->reverse;
 
-  if (ipaddr == NULL) {
+  if (client == NULL) return; // aborted connection
+
+  if (ipaddr == NULL || ipaddr->addr == 0) {
     os_printf("MQTT: DNS lookup failed\n");
-    if (client != NULL) {
-      client->timeoutTick = client->reconTimeout;
-      if (client->reconTimeout < 128) client->reconTimeout <<= 1;
-      client->connState = TCP_RECONNECT_REQ; // the timer will kick-off a reconnection
-    }
+    mqtt_free_pcon(client);
+    mqtt_reconnect_later(client);
     return;
   }
   DBG_MQTT("MQTT: ip %d.%d.%d.%d\n",
@@ -509,34 +1233,15 @@ mqtt_dns_found(const char* name, ip_addr_t* ipaddr, void* arg) {
             *((uint8 *)&ipaddr->addr + 2),
             *((uint8 *)&ipaddr->addr + 3));
 
-  if (client != NULL && client->ip.addr == 0 && ipaddr->addr != 0) {
-    os_memcpy(client->pCon->proto.tcp->remote_ip, &ipaddr->addr, 4);
-    uint8_t err;
-    if (client->security)
-      err = espconn_secure_connect(client->pCon);
-    else
-      err = espconn_connect(client->pCon);
-    if (err != 0) {
-      os_printf("MQTT ERROR: Failed to connect\n");
-      client->timeoutTick = client->reconTimeout;
-      if (client->reconTimeout < 128) client->reconTimeout <<= 1;
-      client->connState = TCP_RECONNECT_REQ;
-    } else {
-      DBG_MQTT("MQTT: connecting...\n");
-    }
-  }
+  // remember the address so reconnects can skip the lookup
+  client->ip = *ipaddr;
+  client->dnsTtl = MQTT_DNS_TTL;
+  client->dnsFails = 0;
+  mqtt_tcp_connect(client, &client->ip);
 }
 
 //===== publish / subscribe
 
-static void ICACHE_FLASH_ATTR
-msg_conn_init(mqtt_connection_t *new_msg, mqtt_connection_t *old_msg,
-    uint8_t *buf, uint16_t buflen) {
-  new_msg->message_id = old_msg->message_id;
-  new_msg->buffer = buf;
-  new_msg->buffer_length = buflen;
-}
-
 /**
 * @brief  MQTT publish function.
 * @param  client: MQTT_Client reference
@@ -554,34 +1259,39 @@ MQTT_Publish(MQTT_Client* client, const char* topic, const char* data, uint16_t
   // estimate the packet size to allocate a buffer
   uint16_t topic_length = os_strlen(topic);
   // estimate: fixed hdr, pkt-id, topic length, topic, data, fudge
-  uint16_t buf_len = 3 + 2 + 2 + topic_length + data_length + 16;
-  PktBuf *buf = PktBuf_New(buf_len);
-  if (buf == NULL) {
-    os_printf("MQTT ERROR: Cannot allocate buffer for %d byte publish\n", buf_len);
-    return FALSE;
-  }
-  // use a temporary mqtt_message_t pointing to our buffer, this is a bit of a mess because we
-  // need to keep track of the message_id that is embedded in it
+  uint16_t buf_len = 3 + 2 + 2 + topic_length + data_length;
+  // assemble the message right in the buffer that gets queued
   mqtt_connection_t msg;
-  msg_conn_init(&msg, &client->mqtt_connection, buf->data, buf_len);
+  PktBuf *buf = mqtt_msg_start(client, &msg, buf_len);
+  if (buf == NULL) return FALSE;
   uint16_t msg_id;
-  if (!mqtt_msg_publish(&msg, topic, data, data_length, qos, retain, &msg_id)){
+  mqtt_msg_publish(&msg, topic, data, data_length, qos, retain, &msg_id);
+  if (mqtt_msg_finish(client, &msg, buf) == NULL) {
     os_printf("MQTT ERROR: Queuing Publish failed\n");
-    os_free(buf);
     return FALSE;
   }
-  client->mqtt_connection.message_id = msg.message_id;
-  if (msg.message.data != buf->data)
-    os_memcpy(buf->data, msg.message.data, msg.message.length);
-  buf->filled = msg.message.length;
 
   DBG_MQTT("MQTT: Publish, topic: \"%s\", length: %d\n", topic, msg.message.length);
   //dumpMem(buf, buf_len);
-  client->msgQueue = PktBuf_Push(client->msgQueue, buf);
 
-  if (!client->sending && client->pending_buffer == NULL) {
-    mqtt_send_message(client);
+  // while offline QoS1 publishes go to the flash spool, and once there's something in the
+  // spool subsequent ones have to follow it there to stay in order
+  MqttSpool *spool = client->spool;
+  if (qos == 1 && spool != NULL && (client->connState != MQTT_CONNECTED || spool->count > 0)) {
+    bool ok = mqtt_spool_put(spool, buf);
+    PktBuf_Free(buf);
+    if (!ok) {
+      os_printf("MQTT ERROR: Spool full, publish dropped\n");
+      return FALSE;
+    }
+    if (client->connState == MQTT_CONNECTED) {
+      mqtt_spool_drain(client);
+      if (mqtt_can_send(client)) mqtt_send_message(client);
+    }
+    return TRUE;
   }
+
+  mqtt_enq_message(client, buf);
   return TRUE;
 }
 
@@ -594,14 +1304,83 @@ MQTT_Publish(MQTT_Client* client, const char* topic, const char* data, uint16_t
 */
 bool ICACHE_FLASH_ATTR
 MQTT_Subscribe(MQTT_Client* client, char* topic, uint8_t qos) {
+  return MQTT_SubscribeCb(client, topic, qos, NULL);
+}
+
+/**
+* @brief  MQTT subscribe with a callback for the messages matching the filter, a SUBSCRIBE
+*         only goes out for the first registration of a filter or to raise its qos
+* @param  client: MQTT_Client reference
+* @param  filter: topic filter, may contain + and # wildcards
+* @param  qos:    qos
+* @param  dataCb: callback, NULL to have the client's dataCb/cmdDataCb called
+* @retval TRUE if success queue
+*/
+bool ICACHE_FLASH_ATTR
+MQTT_SubscribeCb(MQTT_Client* client, const char* filter, uint8_t qos, MqttDataCallback dataCb) {
+  if (filter == NULL || filter[0] == '\0' || os_strlen(filter) >= MQTT_MAX_FILTER) return FALSE;
+  MqttSubNode *node = mqtt_sub_node(client, filter, true);
+  if (node == NULL) {
+    os_printf("MQTT ERROR: Cannot allocate subscription\n");
+    return FALSE;
+  }
+
+  MqttSubHandler *h;
+  for (h = node->handlers; h != NULL && h->cb != dataCb; h = h->next) ;
+  if (h == NULL) {
+    h = (MqttSubHandler *)os_zalloc(sizeof(MqttSubHandler));
+    if (h == NULL) {
+      mqtt_sub_prune(&client->subs);
+      os_printf("MQTT ERROR: Cannot allocate subscription\n");
+      return FALSE;
+    }
+    h->cb = dataCb;
+    h->next = node->handlers;
+    node->handlers = h;
+  }
+  bool subscribed = h->refs > 0 || h->next != NULL;
+  if (h->refs < 0xffff) h->refs++;
+  if (subscribed && qos <= node->qos) {
+    DBG_MQTT("MQTT: Subscribe, topic: \"%s\" already subscribed\n", filter);
+    return TRUE;
+  }
+  node->qos = qos;
+
+  // the SUBSCRIBE goes out once connected, and subscriptions made while a send is under way
+  // are collected to go out together when it completes
+  DBG_MQTT("MQTT: Subscribe, topic: \"%s\"\n", filter);
+  node->pending = true;
+  client->subsPending = true;
+  if (client->sending) return TRUE;
+  return mqtt_sub_send(client);
+}
+
+/**
+* @brief  MQTT unsubscribe function, drops a registration made with MQTT_SubscribeCb and
+*         sends an UNSUBSCRIBE when the last one for the filter is gone
+* @param  client: MQTT_Client reference
+* @param  filter: topic filter as subscribed
+* @param  dataCb: callback as subscribed
+* @retval TRUE if success
+*/
+bool ICACHE_FLASH_ATTR
+MQTT_Unsubscribe(MQTT_Client* client, const char* filter, MqttDataCallback dataCb) {
+  if (filter == NULL || !mqtt_sub_remove(client, filter, dataCb)) return TRUE;
+
+  // fixed header, message id, topic with length
+  mqtt_connection_t msg;
+  PktBuf *buf = mqtt_msg_start(client, &msg, 3 + 2 + mqtt_str_size(filter));
   uint16_t msg_id;
-  if (!mqtt_msg_subscribe(&client->mqtt_connection, topic, 0, &msg_id)) {
-    os_printf("MQTT ERROR: Queuing Subscribe failed (too long)\n");
+  if (buf != NULL) {
+    mqtt_msg_unsubscribe(&msg, filter, &msg_id);
+    buf = mqtt_msg_finish(client, &msg, buf);
+  }
+  if (buf == NULL) {
+    os_printf("MQTT ERROR: Queuing Unsubscribe failed\n");
     return FALSE;
   }
-  DBG_MQTT("MQTT: Subscribe, topic: \"%s\"\n", topic);
-  mqtt_enq_message(client, client->mqtt_connection.message.data,
-      client->mqtt_connection.message.length);
+  DBG_MQTT("MQTT: Unsubscribe, topic: \"%s\"\n", filter);
+  mqtt_enq_message(client, buf);
   return TRUE;
 }
 
@@ -641,6 +1420,8 @@ MQTT_Init(MQTT_Client* client, char* host, uint32 port, uint8_t security, uint8_
   // timeouts with sanity checks
   client->sendTimeout = sendTimeout == 0 ? 1 : sendTimeout;
   client->reconTimeout = 1; // reset reconnect back-off
+  client->inflightWindow = MQTT_MAX_INFLIGHT;
+  client->receiveMax = 0xffff;
 
   os_memset(&client->connect_info, 0, sizeof(mqtt_connect_info_t));
 
@@ -659,8 +1440,10 @@ MQTT_Init(MQTT_Client* client, char* host, uint32 port, uint8_t security, uint8_
   client->in_buffer = (uint8_t *)os_zalloc(MQTT_MAX_RCV_MESSAGE);
   client->in_buffer_size = MQTT_MAX_RCV_MESSAGE;
 
-  uint8_t *out_buffer = (uint8_t *)os_zalloc(MQTT_MAX_SHORT_MESSAGE);
-  mqtt_msg_init(&client->mqtt_connection, out_buffer, MQTT_MAX_SHORT_MESSAGE);
+  // outgoing messages are assembled in their own buffers, mqtt_connection only keeps the
+  // message_id memo
+  mqtt_msg_init(&client->mqtt_connection, NULL, 0);
+  client->mqtt_connection.version = MQTT_PROTOCOL_V311;
 }
 
 /**
@@ -690,6 +1473,7 @@ MQTT_InitLWT(MQTT_Client* client, char* will_topic, char* will_msg,
 void ICACHE_FLASH_ATTR
 MQTT_Connect(MQTT_Client* client) {
   //MQTT_Disconnect(client);
+  mqtt_requeue_inflight(client); // rexmit whatever didn't get acked on the previous connection
   client->pCon = (struct espconn *)os_zalloc(sizeof(struct espconn));
   client->pCon->type = ESPCONN_TCP;
   client->pCon->state = ESPCONN_NONE;
@@ -705,31 +1489,31 @@ MQTT_Connect(MQTT_Client* client) {
   os_timer_setfn(&client->mqttTimer, (os_timer_func_t *)mqtt_timer, client);
   os_timer_arm(&client->mqttTimer, 1000, 1);
 
-  // initiate the TCP connection or DNS lookup
-  os_printf("MQTT: Connect to %s:%d %p (client=%p)\n",
-      client->host, client->port, client->pCon, client);
-  if (UTILS_StrToIP((const char *)client->host,
-        (void*)&client->pCon->proto.tcp->remote_ip)) {
-    uint8_t err;
-    if (client->security)
-      err = espconn_secure_connect(client->pCon);
-    else
-      err = espconn_connect(client->pCon);
-    if (err != 0) {
-      os_printf("MQTT ERROR: Failed to connect\n");
-      os_free(client->pCon->proto.tcp);
-      os_free(client->pCon);
-      client->pCon = NULL;
-      return;
-    }
-  } else {
-    espconn_gethostbyname(client->pCon, (const char *)client->host, &client->ip,
-        mqtt_dns_found);
-  }
-
   client->connState = TCP_CONNECTING;
   client->timeoutTick = 20; // generous timeout to allow for DNS, etc
   client->sending = FALSE;
+  client->connAcked = FALSE;
+  client->receiveMax = 0xffff; // until the CONNACK tells otherwise
+  client->keepAlive = client->connect_info.keepalive < MQTT_MAX_KEEPALIVE ?
+      client->connect_info.keepalive : MQTT_MAX_KEEPALIVE;
+  mqtt_topic_alias_reset(client);
+  client->in_buffer_filled = 0; // drop any partial message from the previous connection
+  client->in_stream_len = 0;
+
+  // initiate the TCP connection, straight to the address from a recent DNS lookup if there
+  // is one, or the DNS lookup
+  os_printf("MQTT: Connect to %s:%d %p (client=%p)\n",
+      client->host, client->port, client->pCon, client);
+  ip_addr_t ip;
+  if (UTILS_StrToIP((const char *)client->host, &ip)) {
+    mqtt_tcp_connect(client, &ip);
+  } else if (client->dnsTtl > 0) {
+    DBG_MQTT("MQTT: Using cached address, %d seconds left\n", client->dnsTtl);
+    mqtt_tcp_connect(client, &client->ip);
+  } else if (espconn_gethostbyname(client->pCon, (const char *)client->host, &client->ip,
+        mqtt_dns_found) == ESPCONN_OK) {
+    mqtt_dns_found(client->host, &client->ip, client->pCon); // answered from lwIP's cache
+  }
 }
 
 static void ICACHE_FLASH_ATTR
@@ -745,13 +1529,11 @@ mqtt_doAbort(MQTT_Client* client) {
   if (client->cmdDisconnectedCb) client->cmdDisconnectedCb(client);
 
   if (client->sending_buffer != NULL) {
-    os_free(client->sending_buffer);
+    PktBuf_Free(client->sending_buffer);
     client->sending_buffer = NULL;
   }
   client->pCon = NULL;         // it will be freed in disconnect callback
-  client->connState = TCP_RECONNECT_REQ;
-  client->timeoutTick = client->reconTimeout;     // reconnect in a few seconds
-  if (client->reconTimeout < 128) client->reconTimeout <<= 1;
+  mqtt_reconnect_later(client);
 }
 
 void ICACHE_FLASH_ATTR
@@ -768,12 +1550,15 @@ void ICACHE_FLASH_ATTR
 MQTT_Disconnect(MQTT_Client* client) {
   DBG_MQTT("MQTT: Disconnect requested\n");
   os_timer_disarm(&client->mqttTimer);
+  client->down = false; // not trying to get back
+  client->dnsTtl = 0;   // it doesn't count down without the timer
   if (client->connState == MQTT_DISCONNECTED) return;
   if (client->connState == TCP_RECONNECT_REQ) {
     client->connState = MQTT_DISCONNECTED;
     return;
   }
   mqtt_doAbort(client);
+  client->down = false;
   //void *out_buffer = client->mqtt_connection.buffer;
   //if (out_buffer != NULL) os_free(out_buffer);
   client->connState = MQTT_DISCONNECTED; // ensure we don't automatically reconnect
@@ -795,10 +1580,34 @@ MQTT_Free(MQTT_Client* client) {
   if (client->in_buffer) os_free(client->in_buffer);
   client->in_buffer = NULL;
 
+  mqtt_requeue_inflight(client);
+  while (client->msgQueue != NULL) client->msgQueue = PktBuf_ShiftFree(client->msgQueue);
+
+  mqtt_sub_free(client->subs);
+  client->subs = NULL;
+
+  if (client->spool) os_free(client->spool);
+  client->spool = NULL;
+
+  mqtt_topic_alias_reset(client);
+
   if (client->mqtt_connection.buffer) os_free(client->mqtt_connection.buffer);
   os_memset(&client->mqtt_connection, 0, sizeof(client->mqtt_connection));
 }
 
+void ICACHE_FLASH_ATTR
+MQTT_SetInflightWindow(MQTT_Client* client, uint8_t window) {
+  if (window < 1) window = 1;
+  if (window > MQTT_MAX_INFLIGHT) window = MQTT_MAX_INFLIGHT;
+  client->inflightWindow = window;
+}
+
+void ICACHE_FLASH_ATTR
+MQTT_SetProtocolVersion(MQTT_Client* client, uint8_t version) {
+  client->mqtt_connection.version = version == MQTT_PROTOCOL_V5 ? MQTT_PROTOCOL_V5 :
+    MQTT_PROTOCOL_V311;
+}
+
 void ICACHE_FLASH_ATTR
 MQTT_OnConnected(MQTT_Client* client, MqttCallback connectedCb) {
   client->connectedCb = connectedCb;
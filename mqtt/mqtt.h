@@ -36,6 +36,35 @@
 // in rest.c
 uint8_t UTILS_StrToIP(const char* str, void *ip);
 
+// max number of messages sent and awaiting an ACK (QoS1/2 publish, subscribe, etc.)
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 8
+#endif
+
+// max seconds between reconnect attempts, the back-off doubles up to this (< 255)
+#ifndef MQTT_MAX_BACKOFF
+#define MQTT_MAX_BACKOFF 128
+#endif
+
+// seconds to reconnect to the broker's IP address without looking its name up again, the SDK
+// doesn't tell the TTL of the DNS record
+#ifndef MQTT_DNS_TTL
+#define MQTT_DNS_TTL 300
+#endif
+
+// longest keep-alive interval in seconds, keepAliveTick holds one more than that
+#define MQTT_MAX_KEEPALIVE 254
+
+// failed connection attempts to the cached IP address after which its name is looked up again
+#ifndef MQTT_DNS_RETRIES
+#define MQTT_DNS_RETRIES 3
+#endif
+
+// max number of topic aliases used for outgoing publishes with MQTT 5
+#ifndef MQTT_MAX_TOPIC_ALIAS
+#define MQTT_MAX_TOPIC_ALIAS 8
+#endif
+
 // State of MQTT connection
 typedef enum {
   MQTT_DISCONNECTED,    // we're in disconnected state
@@ -45,12 +74,15 @@ typedef enum {
 } tConnState;
 
 typedef struct MQTT_Client MQTT_Client; // forward definition
+struct MqttSpool;                        // flash spool, see mqtt_spool.h
+struct MqttSubNode;                      // subscription table, see mqtt.c
 
 // Simple notification callback
 typedef void (*MqttCallback)(MQTT_Client *client);
-// Callback with data messge
+// Callback with data messge, a message too large for the input buffer is delivered in several
+// calls, each with a fragment of the data at offset in the total_len bytes of the message
 typedef void (*MqttDataCallback)(MQTT_Client *client, const char* topic, uint32_t topic_len,
-    const char* data, uint32_t data_len);
+    const char* data, uint32_t data_len, uint32_t offset, uint32_t total_len);
 
 // MQTTY client data structure
 struct MQTT_Client {
@@ -60,26 +92,49 @@ struct MQTT_Client {
   uint16_t            port;
   uint8_t             security;               // 0=tcp, 1=ssl
   ip_addr_t           ip;                     // MQTT server IP address
+  uint16_t            dnsTtl;                 // seconds ip remains valid (0=look it up)
+  uint8_t             dnsFails;               // attempts on ip that didn't get a CONNACK
   mqtt_connect_info_t connect_info;           // info to connect/reconnect
   // protocol state and message assembly
   tConnState          connState;              // connection state
   bool                sending;                // espconn_send is pending
+  bool                connAcked;              // CONNACK received on this connection
   mqtt_connection_t   mqtt_connection;        // message assembly descriptor
   PktBuf*             msgQueue;               // queued outbound messages
   // TCP input buffer
   uint8_t*            in_buffer;
   int                 in_buffer_size;         // length allocated
   int                 in_buffer_filled;       // number of bytes held
-  // outstanding message when we expect an ACK
-  PktBuf*             pending_buffer;         // buffer sent and awaiting ACK
+  uint32_t            in_stream_len;          // payload length of publish being streamed (0=none)
+  uint32_t            in_stream_pos;          // payload bytes of it delivered so far
+  // outstanding messages when we expect an ACK, in the order they were sent
+  PktBuf*             inflight[MQTT_MAX_INFLIGHT]; // buffers sent and awaiting ACK
+  uint8_t             inflightCount;          // number of entries used in inflight[]
+  uint8_t             inflightWindow;         // max entries to use (<= MQTT_MAX_INFLIGHT)
+  uint16_t            receiveMax;             // max entries the broker allows (MQTT 5)
   PktBuf*             sending_buffer;         // buffer sent not awaiting ACK
+  struct MqttSpool*   spool;                  // QoS1 publishes held in flash (NULL=none)
+  struct MqttSubNode* subs;                   // subscribed topic filters
+  bool                subsPending;            // some filters need a SUBSCRIBE sent
+  // MQTT 5 topic aliases of this connection, alias n is topicAlias[n-1]
+  char*               topicAlias[MQTT_MAX_TOPIC_ALIAS];
+  uint8_t             topicAliasMax;          // number of aliases the broker accepts
   // timer and associated timeout counters
   ETSTimer            mqttTimer;              // timer for this connection
+  uint8_t             keepAlive;              // keep-alive interval of this connection (0=none)
   uint8_t             keepAliveTick;          // seconds 'til keep-alive is required (0=no k-a)
   uint8_t             keepAliveAckTick;       // seconds 'til keep-alive ack is overdue (0=no k-a)
   uint8_t             timeoutTick;            // seconds 'til other timeout
   uint8_t             sendTimeout;            // value of send timeout setting
   uint8_t             reconTimeout;           // timeout to reconnect (back-off)
+  // time it takes to get reconnected after the connection got lost
+  bool                down;                   // connection got lost, not reconnected yet
+  uint32_t            downSince;              // system_get_time() when it got lost
+  uint16_t            downTicks;              // seconds since it got lost
+  uint32_t            reconnects;             // number of times it got reconnected
+  uint32_t            reconLastMs;            // time the last reconnect took
+  uint32_t            reconMaxMs;             // longest time a reconnect took
+  uint32_t            reconSumMs;             // sum of the times for averaging
   // callbacks
   MqttCallback        connectedCb;
   MqttCallback        cmdConnectedCb;
@@ -117,20 +172,38 @@ void MQTT_Connect(MQTT_Client* mqttClient);
 // Kill persistent connection
 void MQTT_Disconnect(MQTT_Client* mqttClient);
 
-// Subscribe to a topic
+// Subscribe to a topic, matching messages go to the callbacks set with MQTT_OnData
 bool MQTT_Subscribe(MQTT_Client* client, char* topic, uint8_t qos);
 
+// Subscribe to a topic filter (+ and # wildcards allowed) with a callback that gets just the
+// messages matching it; registrations are counted and only the first one sends a SUBSCRIBE,
+// filters subscribed to in quick succession go out together in one SUBSCRIBE, and they all
+// get subscribed to again on reconnect if the broker didn't keep the session
+bool MQTT_SubscribeCb(MQTT_Client* client, const char* filter, uint8_t qos,
+    MqttDataCallback dataCb);
+
+// Undo one MQTT_SubscribeCb (dataCb=NULL for MQTT_Subscribe), the last one sends an UNSUBSCRIBE
+bool MQTT_Unsubscribe(MQTT_Client* client, const char* filter, MqttDataCallback dataCb);
+
 // Publish a message
 bool MQTT_Publish(MQTT_Client* client, const char* topic, const char* data, uint16_t data_len,
     uint8_t qos, uint8_t retain);
 
+// Set the max number of messages awaiting an ACK, 1 gives stop-and-wait behavior
+void MQTT_SetInflightWindow(MQTT_Client* client, uint8_t window);
+
+// Set the protocol to MQTT_PROTOCOL_V311 (the default) or MQTT_PROTOCOL_V5, must be called
+// before MQTT_Connect; with MQTT 5 outgoing publishes use topic aliases, the broker's Receive Maximum
+// caps the in-flight window, and the reason codes of failed requests get logged
+void MQTT_SetProtocolVersion(MQTT_Client* client, uint8_t version);
+
 // Callback when connected
 void MQTT_OnConnected(MQTT_Client* mqttClient, MqttCallback connectedCb);
 // Callback when disconnected
 void MQTT_OnDisconnected(MQTT_Client* mqttClient, MqttCallback disconnectedCb);
 // Callback when publish succeeded
 void MQTT_OnPublished(MQTT_Client* mqttClient, MqttCallback publishedCb);
-// Callback when data arrives for subscription
+// Callback when data arrives for a subscription made without callback, or for no known one
 void MQTT_OnData(MQTT_Client* mqttClient, MqttDataCallback dataCb);
 
 #endif /* USER_AT_MQTT_H_ */
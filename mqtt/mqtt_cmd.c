@@ -47,17 +47,25 @@ cmdMqttPublishedCb(MQTT_Client* client) {
   cmdResponseEnd();
 }
 
+// Data callback to the uC: topic and data, for a message that arrives in fragments two more
+// args follow with the offset of the fragment and the total length of the message
 void ICACHE_FLASH_ATTR
 cmdMqttDataCb(MQTT_Client* client, const char* topic, uint32_t topic_len,
-    const char* data, uint32_t data_len)
+    const char* data, uint32_t data_len, uint32_t offset, uint32_t total_len)
 {
   if (blocked) return;
   MqttCmdCb* cb = (MqttCmdCb*)client->user_data;
-  DBG("MQTT: Data cb=%p topic=%s len=%u\n", (void*)cb->dataCb, topic, data_len);
+  DBG("MQTT: Data cb=%p topic=%s len=%u@%u/%u\n", (void*)cb->dataCb, topic, data_len,
+      offset, total_len);
 
-  cmdResponseStart(CMD_RESP_CB, cb->dataCb, 2);
+  bool fragment = offset > 0 || data_len < total_len;
+  cmdResponseStart(CMD_RESP_CB, cb->dataCb, fragment ? 4 : 2);
   cmdResponseBody(topic, topic_len);
   cmdResponseBody(data, data_len);
+  if (fragment) {
+    cmdResponseBody(&offset, sizeof(offset));
+    cmdResponseBody(&total_len, sizeof(total_len));
+  }
   cmdResponseEnd();
 }
 
@@ -87,6 +87,16 @@ append_message_id(mqtt_connection_t* connection, uint16_t message_id) {
   return message_id;
 }
 
+// Append the length of the MQTT 5 properties that follow, the caller appends them
+static int ICACHE_FLASH_ATTR
+append_properties(mqtt_connection_t* connection, uint8_t length) {
+  if (connection->message.length + 1 + length > connection->buffer_length)
+    return -1;
+
+  connection->buffer[connection->message.length++] = length; // always < 128
+  return 1;
+}
+
 static int ICACHE_FLASH_ATTR
 init_message(mqtt_connection_t* connection) {
   connection->message.length = MQTT_MAX_FIXED_HEADER_SIZE;
@@ -215,6 +225,104 @@ mqtt_get_publish_data(const uint8_t* buffer, uint16_t* length) {
   return (const char*)(buffer + i);
 }
 
+const uint8_t* ICACHE_FLASH_ATTR
+mqtt_get_publish_props(const uint8_t* buffer, uint16_t* length) {
+  uint32_t remaining;
+  if (*length < 2)
+    return NULL;
+  int i = 1 + mqtt_get_varint(buffer + 1, *length - 1, &remaining);
+  if (i == 1 || i + 2 > *length)
+    return NULL;
+  i += 2 + ((buffer[i] << 8) | buffer[i + 1]); // topic
+  if (mqtt_get_qos(buffer) > 0)
+    i += 2;
+
+  uint32_t props;
+  int n = i < *length ? mqtt_get_varint(buffer + i, *length - i, &props) : 0;
+  if (n == 0 || i + n + props > *length)
+    return NULL;
+
+  *length = props;
+  return buffer + i + n;
+}
+
+int ICACHE_FLASH_ATTR
+mqtt_get_varint(const uint8_t* buffer, uint16_t length, uint32_t* value) {
+  *value = 0;
+  for (int i = 0; i < length && i < 4; ++i) {
+    *value |= (uint32_t)(buffer[i] & 0x7f) << (7 * i);
+    if ((buffer[i] & 0x80) == 0)
+      return i + 1;
+  }
+  return 0;
+}
+
+int ICACHE_FLASH_ATTR
+mqtt_put_varint(uint8_t* buffer, uint32_t value) {
+  int i = 0;
+  do {
+    buffer[i] = value & 0x7f;
+    value >>= 7;
+    if (value > 0)
+      buffer[i] |= 0x80;
+  } while (++i < 4 && value > 0);
+  return i;
+}
+
+int ICACHE_FLASH_ATTR
+mqtt_get_property(const uint8_t* buffer, uint16_t length, uint8_t* id, uint32_t* value) {
+  if (length < 1)
+    return 0;
+  *id = buffer[0];
+
+  switch (*id) {
+    // byte
+    case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2a:
+      if (length < 2)
+        return 0;
+      *value = buffer[1];
+      return 2;
+    // two byte integer
+    case 0x13: case 0x21: case 0x22: case 0x23:
+      if (length < 3)
+        return 0;
+      *value = (buffer[1] << 8) | buffer[2];
+      return 3;
+    // four byte integer
+    case 0x02: case 0x11: case 0x18: case 0x27:
+      if (length < 5)
+        return 0;
+      *value = ((uint32_t)buffer[1] << 24) | ((uint32_t)buffer[2] << 16) |
+        (buffer[3] << 8) | buffer[4];
+      return 5;
+    // variable byte integer
+    case 0x0b: {
+      int n = mqtt_get_varint(buffer + 1, length - 1, value);
+      return n > 0 ? n + 1 : 0;
+    }
+    // string or binary data
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1a: case 0x1c:
+    case 0x1f:
+      if (length < 3)
+        return 0;
+      *value = (buffer[1] << 8) | buffer[2];
+      return 3 + *value <= length ? 3 + *value : 0;
+    // user property, a string pair
+    case 0x26: {
+      if (length < 3)
+        return 0;
+      uint32_t n = 3 + ((buffer[1] << 8) | buffer[2]);
+      if (n + 2 > length)
+        return 0;
+      n += 2 + ((buffer[n] << 8) | buffer[n + 1]);
+      *value = n - 3;
+      return n <= length ? n : 0;
+    }
+    default:
+      return 0;
+  }
+}
+
 uint16_t ICACHE_FLASH_ATTR
 mqtt_get_id(const uint8_t* buffer, uint16_t length) {
   if (length < 1)
@@ -242,7 +350,7 @@ mqtt_get_id(const uint8_t* buffer, uint16_t length) {
       i += topiclen;
 
       if (mqtt_get_qos(buffer) > 0) {
-        if (i + 2 >= length)
+        if (i + 2 > length) // the id may end the message if there's no data
           return 0;
         //i += 2;
       }
@@ -258,11 +366,15 @@ mqtt_get_id(const uint8_t* buffer, uint16_t length) {
     case MQTT_MSG_TYPE_PUBCOMP:
     case MQTT_MSG_TYPE_SUBACK:
     case MQTT_MSG_TYPE_UNSUBACK:
-    case MQTT_MSG_TYPE_SUBSCRIBE: {
-      // This requires the remaining length to be encoded in 1 byte,
-      // which it should be.
-      if (length >= 4 && (buffer[1] & 0x80) == 0)
-        return (buffer[2] << 8) | buffer[3];
+    case MQTT_MSG_TYPE_SUBSCRIBE:
+    case MQTT_MSG_TYPE_UNSUBSCRIBE: {
+      // the id follows the remaining length, which takes more than a byte for a SUBSCRIBE
+      // or SUBACK with many topics
+      int i = 1;
+      while (i < length && (buffer[i] & 0x80) != 0 && i < 4)
+        ++i;
+      if (i + 2 < length)
+        return (buffer[i + 1] << 8) | buffer[i + 2];
       else
         return 0;
     }
@@ -291,7 +403,8 @@ mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_info_t* info) {
 #elif defined(PROTOCOL_NAMEv311)
   variable_header->lengthLsb = 4;
   memcpy(variable_header->magic, "MQTT", 4);
-  variable_header->version = 4;
+  variable_header->version = connection->version == MQTT_PROTOCOL_V5 ?
+    MQTT_PROTOCOL_V5 : MQTT_PROTOCOL_V311;
 #else
 #error "Please define protocol name"
 #endif
@@ -303,6 +416,18 @@ mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_info_t* info) {
   if (info->clean_session)
     variable_header->flags |= MQTT_CONNECT_FLAG_CLEAN_SESSION;
 
+  if (connection->version == MQTT_PROTOCOL_V5) {
+    // without clean session the session is kept forever, like in v3.1.1
+    if (append_properties(connection, info->clean_session ? 0 : 5) < 0)
+      return fail_message(connection);
+    if (!info->clean_session) {
+      uint8_t *p = connection->buffer + connection->message.length;
+      p[0] = MQTT_PROP_SESSION_EXPIRY;
+      p[1] = p[2] = p[3] = p[4] = 0xff;
+      connection->message.length += 5;
+    }
+  }
+
   if (info->client_id != NULL && info->client_id[0] != '\0') {
     if (append_string(connection, info->client_id, strlen(info->client_id)) < 0)
       return fail_message(connection);
@@ -311,6 +436,9 @@ mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_info_t* info) {
     return fail_message(connection);
 
   if (info->will_topic != NULL && info->will_topic[0] != '\0') {
+    if (connection->version == MQTT_PROTOCOL_V5 && append_properties(connection, 0) < 0)
+      return fail_message(connection);
+
     if (append_string(connection, info->will_topic, strlen(info->will_topic)) < 0)
       return fail_message(connection);
 
@@ -399,20 +527,45 @@ mqtt_msg_pubcomp(mqtt_connection_t* connection, uint16_t message_id) {
 
 mqtt_message_t* ICACHE_FLASH_ATTR
 mqtt_msg_subscribe(mqtt_connection_t* connection, const char* topic, int qos, uint16_t* message_id) {
-  init_message(connection);
-
   if (topic == NULL || topic[0] == '\0')
     return fail_message(connection);
 
-  if ((*message_id = append_message_id(connection, 0)) == 0)
+  if (mqtt_msg_subscribe_init(connection, message_id) < 0)
     return fail_message(connection);
 
-  if (append_string(connection, topic, strlen(topic)) < 0)
+  if (mqtt_msg_subscribe_topic(connection, topic, strlen(topic), qos) < 0)
     return fail_message(connection);
 
-  if (connection->message.length + 1 > connection->buffer_length)
-    return fail_message(connection);
+  return mqtt_msg_subscribe_fini(connection);
+}
+
+int ICACHE_FLASH_ATTR
+mqtt_msg_subscribe_init(mqtt_connection_t* connection, uint16_t* message_id) {
+  init_message(connection);
+
+  if ((*message_id = append_message_id(connection, 0)) == 0)
+    return -1;
+  if (connection->version == MQTT_PROTOCOL_V5 && append_properties(connection, 0) < 0)
+    return -1;
+  return 0;
+}
+
+int ICACHE_FLASH_ATTR
+mqtt_msg_subscribe_topic(mqtt_connection_t* connection, const char* topic, int len, int qos) {
+  if (connection->message.length + len + 3 > connection->buffer_length)
+    return -1;
+
+  append_string(connection, topic, len);
   connection->buffer[connection->message.length++] = qos;
+  return len + 3;
+}
+
+mqtt_message_t* ICACHE_FLASH_ATTR
+mqtt_msg_subscribe_fini(mqtt_connection_t* connection) {
+  // there has to be at least one topic after the message id (and properties)
+  int hdr = connection->version == MQTT_PROTOCOL_V5 ? 3 : 2;
+  if (connection->message.length <= MQTT_MAX_FIXED_HEADER_SIZE + hdr)
+    return fail_message(connection);
 
   return fini_message(connection, MQTT_MSG_TYPE_SUBSCRIBE, 0, 1, 0);
 }
@@ -427,6 +580,9 @@ mqtt_msg_unsubscribe(mqtt_connection_t* connection, const char* topic, uint16_t*
   if ((*message_id = append_message_id(connection, 0)) == 0)
     return fail_message(connection);
 
+  if (connection->version == MQTT_PROTOCOL_V5 && append_properties(connection, 0) < 0)
+    return fail_message(connection);
+
   if (append_string(connection, topic, strlen(topic)) < 0)
     return fail_message(connection);
 
@@ -34,6 +34,10 @@
 
 #define PROTOCOL_NAMEv311
 
+// protocol levels
+#define MQTT_PROTOCOL_V311 4
+#define MQTT_PROTOCOL_V5   5
+
 enum mqtt_message_type {
   MQTT_MSG_TYPE_CONNECT = 1,
   MQTT_MSG_TYPE_CONNACK = 2,
@@ -51,6 +55,15 @@ enum mqtt_message_type {
   MQTT_MSG_TYPE_DISCONNECT = 14
 };
 
+// MQTT 5 properties we act on
+enum mqtt_property {
+  MQTT_PROP_SESSION_EXPIRY = 0x11,
+  MQTT_PROP_SERVER_KEEP_ALIVE = 0x13,
+  MQTT_PROP_RECEIVE_MAXIMUM = 0x21,
+  MQTT_PROP_TOPIC_ALIAS_MAXIMUM = 0x22,
+  MQTT_PROP_TOPIC_ALIAS = 0x23,
+};
+
 // Descriptor for a serialized MQTT message, this is returned by functions that compose a message
 // (It's really an MQTT packet in v3.1.1 terminology)
 typedef struct mqtt_message {
@@ -64,6 +77,7 @@ typedef struct mqtt_connection {
   uint16_t message_id;	  // id of assembled message and memo to calculate next message id
   uint8_t* buffer;	  // buffer for assembling messages
   uint16_t buffer_length; // buffer length
+  uint8_t version;        // protocol level, MQTT_PROTOCOL_V311 or MQTT_PROTOCOL_V5
 } mqtt_connection_t;
 
 // Descriptor for a connect request
@@ -110,7 +124,24 @@ const char* mqtt_get_publish_data(const uint8_t* buffer, uint16_t* length);
 // Return message id
 uint16_t mqtt_get_id(const uint8_t* buffer, uint16_t length);
 
-// The following functions construct an outgoing message
+// Return pointer to the properties of an MQTT 5 publish, length in in/out param like above,
+// the data follows the properties
+const uint8_t* mqtt_get_publish_props(const uint8_t* buffer, uint16_t* length);
+
+// Decode a variable byte integer, returns the number of bytes it takes or 0 if it's incomplete
+// or malformed
+int mqtt_get_varint(const uint8_t* buffer, uint16_t length, uint32_t* value);
+
+// Encode a variable byte integer, returns the number of bytes it takes (1 to 4)
+int mqtt_put_varint(uint8_t* buffer, uint32_t value);
+
+// Decode an MQTT 5 property: returns the number of bytes it takes or 0 if malformed, value is
+// the value of integer properties and the length of string and binary ones (at buffer+3)
+int mqtt_get_property(const uint8_t* buffer, uint16_t length, uint8_t* id, uint32_t* value);
+
+// The following functions construct an outgoing message, with connection->version selecting
+// the protocol. Publish messages are always assembled without MQTT 5 properties, they get added
+// as the message is sent
 mqtt_message_t* mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_info_t* info);
 mqtt_message_t* mqtt_msg_publish(mqtt_connection_t* connection, const char* topic, const char* data, int data_length, int qos, int retain, uint16_t* message_id);
 mqtt_message_t* mqtt_msg_puback(mqtt_connection_t* connection, uint16_t message_id);
@@ -118,6 +149,11 @@ mqtt_message_t* mqtt_msg_pubrec(mqtt_connection_t* connection, uint16_t message_
 mqtt_message_t* mqtt_msg_pubrel(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* mqtt_msg_pubcomp(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* mqtt_msg_subscribe(mqtt_connection_t* connection, const char* topic, int qos, uint16_t* message_id);
+// Subscribe to several topics in one message: init, then add each topic, then fini; adding a
+// topic returns -1 if it doesn't fit into the buffer
+int mqtt_msg_subscribe_init(mqtt_connection_t* connection, uint16_t* message_id);
+int mqtt_msg_subscribe_topic(mqtt_connection_t* connection, const char* topic, int len, int qos);
+mqtt_message_t* mqtt_msg_subscribe_fini(mqtt_connection_t* connection);
 mqtt_message_t* mqtt_msg_unsubscribe(mqtt_connection_t* connection, const char* topic, uint16_t* message_id);
 mqtt_message_t* mqtt_msg_pingreq(mqtt_connection_t* connection);
 mqtt_message_t* mqtt_msg_pingresp(mqtt_connection_t* connection);
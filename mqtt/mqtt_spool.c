@@ -0,0 +1,255 @@
+// Offline queue for QoS1 publishes in a ring of flash sectors
+//
+// Each sector starts with a header carrying a sequence number that goes up every time the ring
+// advances to the next sector, which is how the newest sector is found after a reboot. Messages
+// are appended as records: a length word written first, then the data, then a state that marks
+// the record valid, so a record torn by a reset is skipped. A record taken out of the spool stays
+// valid until the broker acks the publish, only then it's marked consumed by clearing its state,
+// which flash allows without an erase; a reset before that sends it again. Sectors are used
+// strictly round-robin so they all see the same number of erase cycles, and a sector only gets
+// erased when the write position moves into it and no unsent or unacked message is left in it.
+
+#include <esp8266.h>
+#include "mqtt_spool.h"
+
+#ifdef MQTT_DBG
+#define DBG_MQTT(format, ...) os_printf(format, ## __VA_ARGS__)
+#else
+#define DBG_MQTT(format, ...) do { } while(0)
+#endif
+
+#define SPOOL_SECT    4096        // flash sector size
+#define SPOOL_MAGIC   0x4c4f5053  // "SPOL"
+#define SPOOL_VALID   0x5a5a      // record state: data complete
+#define SPOOL_DONE    0x0000      // record state: consumed
+#define SPOOL_FREE    0xffff      // record length in erased flash
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+} SpoolSectHdr;
+
+typedef struct {
+  uint16_t len;                   // length of the message in bytes
+  uint16_t state;                 // SPOOL_VALID, SPOOL_DONE, or 0xffff while being written
+} SpoolRecHdr;
+
+#define SPOOL_START   sizeof(SpoolSectHdr) // offset of the first record in a sector
+
+static uint32_t ICACHE_FLASH_ATTR
+spool_addr(MqttSpool *spool, uint8_t sect, uint16_t off) {
+  return spool->addr + sect*SPOOL_SECT + off;
+}
+
+// Space a record takes up in flash, records are word-aligned
+static uint16_t ICACHE_FLASH_ATTR
+spool_rec_size(uint16_t len) {
+  return sizeof(SpoolRecHdr) + ((len+3) & ~3);
+}
+
+// Read the record header at off, returns false at the end of the records in the sector
+static bool ICACHE_FLASH_ATTR
+spool_read_rec(MqttSpool *spool, uint8_t sect, uint16_t off, SpoolRecHdr *rec) {
+  if (off + sizeof(SpoolRecHdr) > SPOOL_SECT) return false;
+  if (spi_flash_read(spool_addr(spool, sect, off), (uint32_t *)rec, sizeof(*rec))
+      != SPI_FLASH_RESULT_OK) return false;
+  return rec->len != SPOOL_FREE && off + spool_rec_size(rec->len) <= SPOOL_SECT;
+}
+
+// Write a record header, the header word only ever gets bits cleared after the erase
+static bool ICACHE_FLASH_ATTR
+spool_write_rec(MqttSpool *spool, uint8_t sect, uint16_t off, uint16_t len, uint16_t state) {
+  SpoolRecHdr rec = { len, state };
+  return spi_flash_write(spool_addr(spool, sect, off), (uint32_t *)&rec, sizeof(rec))
+    == SPI_FLASH_RESULT_OK;
+}
+
+// Erase the next sector in the ring and make it the one being written
+static bool ICACHE_FLASH_ATTR
+spool_next_sect(MqttSpool *spool) {
+  uint8_t sect = spool->wrOff == 0 ? spool->wrSect : (spool->wrSect+1) % spool->sectors;
+  if (spool->count > 0 && sect == spool->rdSect) return false; // ring is full
+  for (uint8_t i=0; i<spool->unackedCount; i++)
+    if ((spool->unacked[i].rec - spool->addr) / SPOOL_SECT == sect) return false; // still sending
+
+  SpoolSectHdr hdr = { SPOOL_MAGIC, spool->seq+1 };
+  if (spi_flash_erase_sector(spool_addr(spool, sect, 0) / SPOOL_SECT) != SPI_FLASH_RESULT_OK ||
+      spi_flash_write(spool_addr(spool, sect, 0), (uint32_t *)&hdr, sizeof(hdr))
+        != SPI_FLASH_RESULT_OK) {
+    os_printf("MQTT ERROR: Cannot erase spool sector %d\n", sect);
+    return false;
+  }
+  spool->seq = hdr.seq;
+  spool->wrSect = sect;
+  spool->wrOff = SPOOL_START;
+  return true;
+}
+
+bool ICACHE_FLASH_ATTR
+mqtt_spool_put(MqttSpool *spool, PktBuf *buf) {
+  uint16_t size = spool_rec_size(buf->filled);
+  if (spool->count >= spool->max || size > SPOOL_SECT - SPOOL_START) {
+    spool->dropped++;
+    return false;
+  }
+  if ((spool->wrOff == 0 || spool->wrOff + size > SPOOL_SECT) && !spool_next_sect(spool)) {
+    spool->dropped++;
+    return false;
+  }
+  if (spool->count == 0) {
+    // nothing left to read before this record, skip the reader ahead to it
+    spool->rdSect = spool->wrSect;
+    spool->rdOff = spool->wrOff;
+  }
+
+  // length first, then the data, and only then mark the record valid
+  uint16_t off = spool->wrOff;
+  bool ok = spool_write_rec(spool, spool->wrSect, off, buf->filled, 0xffff);
+  uint32_t tmp[32];
+  for (uint16_t i=0; ok && i<buf->filled; i+=sizeof(tmp)) {
+    uint16_t n = buf->filled - i < sizeof(tmp) ? buf->filled - i : sizeof(tmp);
+    os_memset(tmp, 0xff, sizeof(tmp));
+    os_memcpy(tmp, buf->data+i, n);
+    ok = spi_flash_write(spool_addr(spool, spool->wrSect, off+sizeof(SpoolRecHdr)+i),
+        tmp, (n+3) & ~3) == SPI_FLASH_RESULT_OK;
+  }
+  ok = ok && spool_write_rec(spool, spool->wrSect, off, buf->filled, SPOOL_VALID);
+  spool->wrOff += size; // a failed record stays behind as garbage, it's skipped on read
+  if (!ok) {
+    os_printf("MQTT ERROR: Cannot write spool at 0x%lx\n",
+        (unsigned long)spool_addr(spool, spool->wrSect, off));
+    spool->dropped++;
+    return false;
+  }
+  spool->count++;
+  spool->stored++;
+  return true;
+}
+
+PktBuf * ICACHE_FLASH_ATTR
+mqtt_spool_get(MqttSpool *spool, uint16_t msg_id) {
+  while (spool->count > 0) {
+    if (spool->rdSect == spool->wrSect && spool->rdOff >= spool->wrOff) {
+      spool->count = 0; // caught up with the writer, count was off
+      break;
+    }
+    SpoolRecHdr rec;
+    if (!spool_read_rec(spool, spool->rdSect, spool->rdOff, &rec)) {
+      if (spool->rdSect == spool->wrSect) {
+        spool->count = 0; // garbage where the writer's records should be
+        break;
+      }
+      spool->rdSect = (spool->rdSect+1) % spool->sectors;
+      spool->rdOff = SPOOL_START;
+      continue;
+    }
+    uint16_t off = spool->rdOff;
+    spool->rdOff += spool_rec_size(rec.len);
+    if (rec.state != SPOOL_VALID) continue;
+
+    PktBuf *buf = PktBuf_New((rec.len+3) & ~3);
+    if (buf == NULL) {
+      spool->rdOff = off; // try again later
+      return NULL;
+    }
+    if (spi_flash_read(spool_addr(spool, spool->rdSect, off+sizeof(SpoolRecHdr)),
+          (uint32_t *)buf->data, (rec.len+3) & ~3) != SPI_FLASH_RESULT_OK) {
+      os_printf("MQTT ERROR: Cannot read spool at 0x%lx\n",
+          (unsigned long)spool_addr(spool, spool->rdSect, off));
+      PktBuf_Free(buf);
+      spool->count--;
+      continue;
+    }
+    buf->filled = rec.len;
+    if (spool->unackedCount < MQTT_MAX_INFLIGHT) {
+      MqttSpoolUnacked *u = &spool->unacked[spool->unackedCount++];
+      u->msgId = msg_id;
+      u->rec = spool_addr(spool, spool->rdSect, off);
+    } else {
+      spool_write_rec(spool, spool->rdSect, off, rec.len, SPOOL_DONE); // can't keep track
+    }
+    spool->count--;
+    return buf;
+  }
+  return NULL;
+}
+
+void ICACHE_FLASH_ATTR
+mqtt_spool_ack(MqttSpool *spool, uint16_t msg_id) {
+  for (uint8_t i=0; i<spool->unackedCount; i++) {
+    MqttSpoolUnacked *u = &spool->unacked[i];
+    if (u->msgId != msg_id) continue;
+    SpoolRecHdr rec;
+    if (spi_flash_read(u->rec, (uint32_t *)&rec, sizeof(rec)) == SPI_FLASH_RESULT_OK) {
+      rec.state = SPOOL_DONE;
+      spi_flash_write(u->rec, (uint32_t *)&rec, sizeof(rec));
+    }
+    *u = spool->unacked[--spool->unackedCount];
+    return;
+  }
+}
+
+// Scan a sector's records, counting the valid ones and noting where the first one is and
+// where the records end
+static void ICACHE_FLASH_ATTR
+spool_scan_sect(MqttSpool *spool, uint8_t sect) {
+  SpoolRecHdr rec;
+  uint16_t off = SPOOL_START;
+  while (spool_read_rec(spool, sect, off, &rec)) {
+    if (rec.state == SPOOL_VALID) {
+      if (spool->count++ == 0) {
+        spool->rdSect = sect;
+        spool->rdOff = off;
+      }
+    }
+    off += spool_rec_size(rec.len);
+  }
+  if (sect == spool->wrSect) spool->wrOff = off;
+}
+
+bool ICACHE_FLASH_ATTR
+MQTT_SpoolInit(MQTT_Client *client, uint32_t addr, uint8_t sectors, uint16_t max) {
+  if (sectors == 0 || (addr & (SPOOL_SECT-1)) != 0) return false;
+  MqttSpool *spool = client->spool;
+  if (spool == NULL) spool = (MqttSpool *)os_zalloc(sizeof(MqttSpool));
+  if (spool == NULL) return false;
+  os_memset(spool, 0, sizeof(MqttSpool));
+  spool->addr = addr;
+  spool->sectors = sectors;
+  spool->max = max;
+
+  // the newest sector is the one with the highest sequence number
+  SpoolSectHdr hdr[sectors];
+  bool found = false;
+  for (uint8_t s=0; s<sectors; s++) {
+    if (spi_flash_read(spool_addr(spool, s, 0), (uint32_t *)&hdr[s], sizeof(hdr[s]))
+        != SPI_FLASH_RESULT_OK) hdr[s].magic = 0;
+    if (hdr[s].magic != SPOOL_MAGIC) continue;
+    if (!found || hdr[s].seq > spool->seq) {
+      spool->seq = hdr[s].seq;
+      spool->wrSect = s;
+      found = true;
+    }
+  }
+
+  // the sectors before it in the ring hold older messages if their sequence numbers line up,
+  // scan them oldest first so the reader starts at the oldest message
+  if (found) {
+    for (uint8_t i=1; i<=sectors; i++) {
+      uint8_t s = (spool->wrSect + i) % sectors;
+      if (hdr[s].magic == SPOOL_MAGIC && hdr[s].seq == spool->seq - (sectors - i))
+        spool_scan_sect(spool, s);
+    }
+  }
+  if (spool->count == 0) {
+    spool->rdSect = spool->wrSect;
+    spool->rdOff = spool->wrOff;
+  }
+
+  client->spool = spool;
+  os_printf("MQTT: Spool of %d sectors at 0x%lx holds %d messages\n", sectors,
+      (unsigned long)addr, spool->count);
+  DBG_MQTT("MQTT: Spool writes sector %d at %d, seq %lu\n", spool->wrSect, spool->wrOff,
+      (unsigned long)spool->seq);
+  return true;
+}
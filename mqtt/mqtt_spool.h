@@ -0,0 +1,44 @@
+// Offline queue for QoS1 publishes in a ring of flash sectors
+
+#ifndef MQTT_SPOOL_H
+#define MQTT_SPOOL_H
+
+#include "mqtt.h"
+
+// A message taken out of the spool that stays in flash until the broker acks it
+typedef struct {
+  uint16_t msgId;       // message id it was sent with
+  uint32_t rec;         // flash address of its record
+} MqttSpoolUnacked;
+
+typedef struct MqttSpool {
+  uint32_t addr;        // flash address of the first sector of the ring
+  uint8_t  sectors;     // number of sectors in the ring
+  uint8_t  wrSect;      // sector being appended to
+  uint8_t  rdSect;      // sector holding the oldest message
+  uint16_t wrOff;       // offset in wrSect of the next record, 0: sector not started
+  uint16_t rdOff;       // offset in rdSect of the oldest message
+  uint16_t max;         // max number of messages held
+  uint16_t count;       // number of messages held
+  uint32_t seq;         // sequence number of wrSect, tells the age of sectors
+  uint32_t stored;      // messages written to flash
+  uint32_t dropped;     // messages that didn't fit
+  uint8_t  unackedCount; // entries used in unacked[]
+  MqttSpoolUnacked unacked[MQTT_MAX_INFLIGHT];
+} MqttSpool;
+
+// Start spooling QoS1 publishes to the flash sectors at addr while the client is not connected,
+// messages already in flash from before a reboot get sent once connected
+bool MQTT_SpoolInit(MQTT_Client* client, uint32_t addr, uint8_t sectors, uint16_t max);
+
+// Append a publish message, returns false if the spool is full
+bool mqtt_spool_put(MqttSpool* spool, PktBuf* buf);
+
+// Take the oldest message out of the spool to be sent with msg_id, returns NULL if it's empty.
+// Its record stays in flash, so it gets sent again after a reset, until mqtt_spool_ack.
+PktBuf* mqtt_spool_get(MqttSpool* spool, uint16_t msg_id);
+
+// The broker acked the message sent with msg_id, drop it from flash if it came from the spool
+void mqtt_spool_ack(MqttSpool* spool, uint16_t msg_id);
+
+#endif
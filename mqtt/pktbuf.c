@@ -19,16 +19,72 @@
 #endif
 
 
+// Size classes: acks and pings, short messages, typical publishes, a full TCP segment; the
+// last entry counts buffers larger than that, which come straight from the heap
+static PktBufPool pools[] = {
+  { .size = 16,   .keep = 8 },
+  { .size = 64,   .keep = 8 },
+  { .size = 256,  .keep = 4 },
+  { .size = 1460, .keep = 1 },
+  { .size = 0xffff },
+};
+#define PKTBUF_CLASSES (sizeof(pools)/sizeof(PktBufPool) - 1)
+
+static PktBuf *freeBufs[PKTBUF_CLASSES]; // free buffers of each class, chained through next
+
+static int ICACHE_FLASH_ATTR
+PktBuf_Class(uint16_t length) {
+  int c = 0;
+  while (c < PKTBUF_CLASSES && length > pools[c].size) c++;
+  return c;
+}
+
 PktBuf * ICACHE_FLASH_ATTR
 PktBuf_New(uint16_t length) {
-  PktBuf *buf = os_zalloc(length+sizeof(PktBuf));
+  int c = PktBuf_Class(length);
+  PktBufPool *pool = &pools[c];
+  PktBuf *buf;
+  if (c < PKTBUF_CLASSES && freeBufs[c] != NULL) {
+    buf = freeBufs[c];
+    freeBufs[c] = buf->next;
+    pool->pooled--;
+    pool->reuses++;
+  } else {
+    uint16_t size = c < PKTBUF_CLASSES ? pool->size : length;
+    buf = os_malloc(size+sizeof(PktBuf));
+    if (buf == NULL) return NULL;
+    buf->size = size;
+    pool->allocs++;
+  }
+  if (++pool->inUse > pool->maxInUse) pool->maxInUse = pool->inUse;
   buf->next = NULL;
+  buf->data = buf->mem;
   buf->filled = 0;
   //os_printf("PktBuf_New: %p l=%d->%d d=%p\n",
-  //    buf, length, length+sizeof(PktBuf), buf->data);
+  //    buf, length, buf->size+sizeof(PktBuf), buf->data);
   return buf;
 }
 
+void ICACHE_FLASH_ATTR
+PktBuf_Free(PktBuf *buf) {
+  int c = PktBuf_Class(buf->size);
+  PktBufPool *pool = &pools[c];
+  pool->inUse--;
+  if (c < PKTBUF_CLASSES && pool->pooled < pool->keep) {
+    buf->next = freeBufs[c];
+    freeBufs[c] = buf;
+    pool->pooled++;
+  } else {
+    os_free(buf);
+  }
+}
+
+const PktBufPool * ICACHE_FLASH_ATTR
+PktBuf_GetStats(int *num) {
+  *num = PKTBUF_CLASSES + 1;
+  return pools;
+}
+
 PktBuf * ICACHE_FLASH_ATTR
 PktBuf_Push(PktBuf *headBuf, PktBuf *buf) {
   if (headBuf == NULL) {
@@ -61,6 +117,6 @@ PktBuf * ICACHE_FLASH_ATTR
 PktBuf_ShiftFree(PktBuf *headBuf) {
   PktBuf *buf = headBuf->next;
   //os_printf("PktBuf_ShiftFree: (%p)->%p\n", headBuf, buf);
-  os_free(headBuf);
+  PktBuf_Free(headBuf);
   return buf;
 }
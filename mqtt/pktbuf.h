@@ -5,13 +5,30 @@
 
 typedef struct PktBuf {
   struct PktBuf *next;   // next buffer in chain
+  uint8_t       *data;   // start of data, normally mem but may be a little further in
   uint16_t      filled;  // number of bytes filled in buffer
-  uint8_t       data[0]; // data in buffer
+  uint16_t      size;    // number of bytes allocated at mem
+  uint8_t       mem[0];  // buffer memory
 } PktBuf;
 
+// Buffers are allocated from pools of a few size classes, freed buffers are kept for reuse
+// up to a per-class limit so sustained traffic doesn't keep fragmenting the heap
+typedef struct {
+  uint16_t size;      // bytes of data a buffer in this class holds
+  uint8_t  keep;      // max number of free buffers kept in the pool
+  uint8_t  pooled;    // number of free buffers in the pool
+  uint16_t inUse;     // number of buffers handed out
+  uint16_t maxInUse;  // high-water mark of inUse
+  uint32_t allocs;    // buffers allocated from the heap
+  uint32_t reuses;    // buffers handed out from the pool
+} PktBufPool;
+
 // Allocate a new packet buffer of given length
 PktBuf *PktBuf_New(uint16_t length);
 
+// Free a packet buffer, returning it to its pool
+void PktBuf_Free(PktBuf *buf);
+
 // Append a buffer to the end of a packet buffer queue, returns new head
 PktBuf *PktBuf_Push(PktBuf *headBuf, PktBuf *buf);
 
@@ -24,4 +41,7 @@ PktBuf *PktBuf_Shift(PktBuf *headBuf);
 // Shift first buffer off queue, free it, return new head
 PktBuf *PktBuf_ShiftFree(PktBuf *headBuf);
 
+// Get the per-class pool statistics, the last entry is for buffers too large for any class
+const PktBufPool *PktBuf_GetStats(int *num);
+
 #endif
@@ -141,50 +141,83 @@ ajaxConsoleSend(HttpdConnData *connData) {
 int ICACHE_FLASH_ATTR
 ajaxConsole(HttpdConnData *connData) {
   if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
-  char buff[2048];
+  char buff[64];
   int len; // length of text in buff
   int console_len = (console_wr+BUF_MAX-console_rd) % BUF_MAX; // num chars in console_buf
-  int start = 0; // offset onto console_wr to start sending out chars
-
-  jsonHeader(connData, 200);
 
-  // figure out where to start in buffer based on URI param
-  len = httpdFindArg(connData->getArgs, "start", buff, sizeof(buff));
-  if (len > 0) {
-    start = atoi(buff);
-    if (start < console_pos) {
-      start = 0;
-    } else if (start >= console_pos+console_len) {
-      start = console_len;
-    } else {
-      start = start - console_pos;
+  // the text gets streamed over as many callbacks as it takes: cgiData-1 is the console
+  // position to continue at (0 means first call) and cgiPrivData the position to stop at
+  if (connData->cgiData == NULL) {
+    int start = 0; // offset onto console_rd to start sending out chars
+
+    // figure out where to start in buffer based on URI param
+    len = httpdFindArg(connData->getArgs, "start", buff, sizeof(buff));
+    if (len > 0) {
+      start = atoi(buff);
+      if (start < console_pos) {
+        start = 0;
+      } else if (start >= console_pos+console_len) {
+        start = console_len;
+      } else {
+        start = start - console_pos;
+      }
     }
+
+    httpdSetTransferMode(connData, HTTPD_TRANSFER_CHUNKED);
+    jsonHeader(connData, 200);
+    len = os_sprintf(buff, "{\"len\":%d, \"start\":%d, \"text\": \"",
+        console_len-start, console_pos+start);
+    httpdSend(connData, buff, len);
+    connData->cgiData = (void *)(console_pos+start+1);
+    connData->cgiPrivData = (void *)(console_pos+console_len);
   }
 
-  // start outputting
-  len = os_sprintf(buff, "{\"len\":%d, \"start\":%d, \"text\": \"",
-      console_len-start, console_pos+start);
+  int pos = (int)connData->cgiData - 1;
+  int end = (int)connData->cgiPrivData;
+  if (pos < console_pos) pos = console_pos; // overwritten while we were sending
+  if (end > console_pos+console_len) end = console_pos+console_len; // console got cleared
 
-  int rd = (console_rd+start) % BUF_MAX;
-  while (len < 2040 && rd != console_wr) {
-    uint8_t c = console_buf[rd];
+  int avail;
+  char *out = httpdSendBuffer(connData, &avail);
+  len = 0;
+  while (len < avail-8 && pos < end) { // 8: room for \uXXXX and the closing "}
+    uint8_t c = console_buf[(console_rd+pos-console_pos) % BUF_MAX];
     if (c == '\\' || c == '"') {
-      buff[len++] = '\\';
-      buff[len++] = c;
+      out[len++] = '\\';
+      out[len++] = c;
     } else if (c == '\r') {
       // this is crummy, but browsers display a newline for \r\n sequences
     } else if (c < ' ') {
-      len += os_sprintf(buff+len, "\\u%04x", c);
+      len += os_sprintf(out+len, "\\u%04x", c);
     } else {
-      buff[len++] = c;
+      out[len++] = c;
     }
-    rd = (rd + 1) % BUF_MAX;
+    pos++;
   }
-  os_strcpy(buff+len, "\"}"); len+=2;
-  httpdSend(connData, buff, len);
+
+  if (pos < end) {
+    httpdSendCommit(connData, len);
+    connData->cgiData = (void *)(pos+1);
+    return HTTPD_CGI_MORE;
+  }
+  os_memcpy(out+len, "\"}", 2); len+=2;
+  httpdSendCommit(connData, len);
   return HTTPD_CGI_DONE;
 }
 
+// Data received on the /ws/console websocket goes straight out the uart
+static void ICACHE_FLASH_ATTR
+consoleWsRecv(Websock *ws, char *data, int len, int flags) {
+  if (len == 0) return;
+  serledFlash(50); // short blink on serial LED
+  uart0_tx_buffer(data, len);
+}
+
+void ICACHE_FLASH_ATTR
+consoleWsConnect(Websock *ws) {
+  ws->recvCb = consoleWsRecv;
+}
+
 void ICACHE_FLASH_ATTR consoleInit() {
   console_wr = 0;
   console_rd = 0;
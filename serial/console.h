@@ -2,6 +2,7 @@
 #define CONSOLE_H
 
 #include "httpd.h"
+#include "websocket.h"
 
 void consoleInit(void);
 void ICACHE_FLASH_ATTR console_write_char(char c);
@@ -11,6 +12,7 @@ int ajaxConsoleClear(HttpdConnData *connData);
 int ajaxConsoleBaud(HttpdConnData *connData);
 int ajaxConsoleFormat(HttpdConnData *connData);
 int ajaxConsoleSend(HttpdConnData *connData);
+void consoleWsConnect(Websock *ws);
 int tplConsole(HttpdConnData *connData, char *token, void **arg);
 
 #endif
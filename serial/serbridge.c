@@ -460,6 +460,8 @@ console_process(char *buf, short len)
       espbuffsend(&connData[i], buf, len);
     }
   }
+  // and into each console websocket
+  cgiWebsockBroadcast("/ws/console", buf, len, WEBSOCK_FLAG_BIN);
 }
 
 // callback with a buffer of characters that have arrived on the uart